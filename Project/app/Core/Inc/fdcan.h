@@ -37,7 +37,24 @@ extern FDCAN_HandleTypeDef hfdcan1;
 extern FDCAN_HandleTypeDef hfdcan2;
 
 /* USER CODE BEGIN Private defines */
+/* FDCAN1 events go to interrupt line 0 (TIM16_FDCAN_IT0), FDCAN2 to line 1 (TIM17_FDCAN_IT1),
+ * so each bus has its own vector and NVIC priority */
+#define FDCAN1_INTERRUPT_LINE FDCAN_INTERRUPT_LINE0
+#define FDCAN2_INTERRUPT_LINE FDCAN_INTERRUPT_LINE1
+#ifndef FDCAN1_IRQ_PRIORITY
+#define FDCAN1_IRQ_PRIORITY 0
+#endif
+#ifndef FDCAN2_IRQ_PRIORITY
+#define FDCAN2_IRQ_PRIORITY 0
+#endif
 
+#if FDCAN_CLOCK_SOURCE == FDCAN_CLOCK_PLLQ
+#define FDCAN_KERNEL_CLOCK RCC_FDCANCLKSOURCE_PLL
+#elif FDCAN_CLOCK_SOURCE == FDCAN_CLOCK_HSE
+#define FDCAN_KERNEL_CLOCK RCC_FDCANCLKSOURCE_HSE
+#else
+#define FDCAN_KERNEL_CLOCK RCC_FDCANCLKSOURCE_PCLK1
+#endif
 /* USER CODE END Private defines */
 
 void MX_FDCAN1_Init(void);
@@ -59,6 +59,14 @@ void Error_Handler(void);
 /* Private defines -----------------------------------------------------------*/
 
 /* USER CODE BEGIN Private defines */
+/* FDCAN kernel clock, chosen at build time. PLLQ runs at 80 MHz, which gives exact
+ * sample points for 2/4/5/8 Mbit/s data phases; USB then moves to HSI48 trimmed by CRS. */
+#define FDCAN_CLOCK_PCLK1 0 /* 60 MHz */
+#define FDCAN_CLOCK_PLLQ 1  /* 80 MHz */
+#define FDCAN_CLOCK_HSE 2   /* 12 MHz */
+#ifndef FDCAN_CLOCK_SOURCE
+#define FDCAN_CLOCK_SOURCE FDCAN_CLOCK_PCLK1
+#endif
 
 /* USER CODE END Private defines */
 
@@ -55,6 +55,7 @@ void USB_UCPD1_2_IRQHandler(void);
 void TIM16_FDCAN_IT0_IRQHandler(void);
 void TIM17_FDCAN_IT1_IRQHandler(void);
 /* USER CODE BEGIN EFP */
+void TIM2_IRQHandler(void);
 
 /* USER CODE END EFP */
 
@@ -25,7 +25,10 @@
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
-
+#include "gs_cyclic.h"
+#include "gs_replay.h"
+#include "gs_timer.h"
+#include "gs_usb.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -93,6 +96,9 @@ int main(void) {
     MX_FDCAN1_Init();
     MX_FDCAN2_Init();
     /* USER CODE BEGIN 2 */
+    gs_timer_init();
+    gs_cyclic_init();
+    gs_replay_init();
     HAL_PCD_EP_Open(&hpcd_USB_DRD_FS, 0x00, 64, EP_TYPE_CTRL);
     HAL_PCD_EP_Open(&hpcd_USB_DRD_FS, 0x80, 64, EP_TYPE_CTRL);
     HAL_PCD_Start(&hpcd_USB_DRD_FS);
@@ -104,6 +110,8 @@ int main(void) {
         /* USER CODE END WHILE */
 
         /* USER CODE BEGIN 3 */
+        usb_ep0_poll();
+        gs_usb_poll();
     }
     /* USER CODE END 3 */
 }
@@ -125,12 +133,21 @@ void SystemClock_Config(void) {
    */
     RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSE;
     RCC_OscInitStruct.HSEState = RCC_HSE_ON;
+#if FDCAN_CLOCK_SOURCE == FDCAN_CLOCK_PLLQ
+    /* PLLQ belongs to FDCAN, USB runs from HSI48 */
+    RCC_OscInitStruct.OscillatorType |= RCC_OSCILLATORTYPE_HSI48;
+    RCC_OscInitStruct.HSI48State = RCC_HSI48_ON;
+#endif
     RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
     RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_HSE;
     RCC_OscInitStruct.PLL.PLLM = RCC_PLLM_DIV1;
     RCC_OscInitStruct.PLL.PLLN = 20;
     RCC_OscInitStruct.PLL.PLLP = RCC_PLLP_DIV2;
+#if FDCAN_CLOCK_SOURCE == FDCAN_CLOCK_PLLQ
+    RCC_OscInitStruct.PLL.PLLQ = RCC_PLLQ_DIV3;
+#else
     RCC_OscInitStruct.PLL.PLLQ = RCC_PLLQ_DIV5;
+#endif
     RCC_OscInitStruct.PLL.PLLR = RCC_PLLR_DIV4;
     if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK) { Error_Handler(); }
 
@@ -22,6 +22,7 @@
 #include "stm32g0xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "gs_timer.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -158,6 +159,7 @@ void USB_UCPD1_2_IRQHandler(void)
 
 /**
   * @brief This function handles TIM16, FDCAN1_IT0 and FDCAN2_IT0 Interrupt.
+  *        All FDCAN1 events are routed to line 0.
   */
 void TIM16_FDCAN_IT0_IRQHandler(void)
 {
@@ -165,7 +167,6 @@ void TIM16_FDCAN_IT0_IRQHandler(void)
 
   /* USER CODE END TIM16_FDCAN_IT0_IRQn 0 */
   HAL_FDCAN_IRQHandler(&hfdcan1);
-  HAL_FDCAN_IRQHandler(&hfdcan2);
   /* USER CODE BEGIN TIM16_FDCAN_IT0_IRQn 1 */
 
   /* USER CODE END TIM16_FDCAN_IT0_IRQn 1 */
@@ -173,13 +174,13 @@ void TIM16_FDCAN_IT0_IRQHandler(void)
 
 /**
   * @brief This function handles TIM17, FDCAN1_IT1 and FDCAN2_IT1 Interrupt.
+  *        All FDCAN2 events are routed to line 1.
   */
 void TIM17_FDCAN_IT1_IRQHandler(void)
 {
   /* USER CODE BEGIN TIM17_FDCAN_IT1_IRQn 0 */
 
   /* USER CODE END TIM17_FDCAN_IT1_IRQn 0 */
-  HAL_FDCAN_IRQHandler(&hfdcan1);
   HAL_FDCAN_IRQHandler(&hfdcan2);
   /* USER CODE BEGIN TIM17_FDCAN_IT1_IRQn 1 */
 
@@ -188,4 +189,12 @@ void TIM17_FDCAN_IT1_IRQHandler(void)
 
 /* USER CODE BEGIN 1 */
 
+/**
+  * @brief This function handles TIM2 global interrupt: device clock alarms.
+  */
+void TIM2_IRQHandler(void)
+{
+  gs_timer_irq_handler();
+}
+
 /* USER CODE END 1 */
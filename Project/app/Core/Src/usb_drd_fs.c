@@ -74,9 +74,26 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef *pcdHandle) {
         /** Initializes the peripherals clocks
   */
         PeriphClkInit.PeriphClockSelection = RCC_PERIPHCLK_USB;
+#if FDCAN_CLOCK_SOURCE == FDCAN_CLOCK_PLLQ
+        PeriphClkInit.UsbClockSelection = RCC_USBCLKSOURCE_HSI48;
+#else
         PeriphClkInit.UsbClockSelection = RCC_USBCLKSOURCE_PLL;
+#endif
         if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInit) != HAL_OK) { Error_Handler(); }
 
+#if FDCAN_CLOCK_SOURCE == FDCAN_CLOCK_PLLQ
+        /* Keep HSI48 within USB tolerance by trimming it against the host SOF */
+        RCC_CRSInitTypeDef CrsInit = {0};
+        __HAL_RCC_CRS_CLK_ENABLE();
+        CrsInit.Prescaler = RCC_CRS_SYNC_DIV1;
+        CrsInit.Source = RCC_CRS_SYNC_SOURCE_USB;
+        CrsInit.Polarity = RCC_CRS_SYNC_POLARITY_RISING;
+        CrsInit.ReloadValue = __HAL_RCC_CRS_RELOADVALUE_CALCULATE(48000000, 1000);
+        CrsInit.ErrorLimitValue = RCC_CRS_ERRORLIMIT_DEFAULT;
+        CrsInit.HSI48CalibrationValue = RCC_CRS_HSI48CALIBRATION_DEFAULT;
+        HAL_RCCEx_CRSConfig(&CrsInit);
+#endif
+
         /* USB_DRD_FS clock enable */
         __HAL_RCC_USB_CLK_ENABLE();
 
@@ -0,0 +1,135 @@
+#include "gs_cyclic.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "gs_mram.h"
+#include "gs_timer.h"
+
+struct gs_cyclic_entry {
+    struct gs_cyclic_msg msg;
+    uint32_t due_us;
+    uint8_t active;
+};
+
+static struct gs_cyclic_entry gs_cyclic[NUM_CAN_CHANNELS][GS_CYCLIC_MAX_MSGS];
+
+static void gs_cyclic_send(uint8_t channel, struct gs_cyclic_entry *e) {
+    struct gs_host_frame frm;
+    uint8_t len = gs_dlc_to_len[e->msg.can_dlc];
+
+    if (e->msg.counter_pos < len) {
+        e->msg.data[e->msg.counter_pos]++;
+    }
+    if (e->msg.checksum_pos < len) {
+        uint8_t sum = 0;
+        for (uint8_t i = 0; i < len; i++) {
+            if (i != e->msg.checksum_pos) {
+                sum = (uint8_t) (sum + e->msg.data[i]);
+            }
+        }
+        e->msg.data[e->msg.checksum_pos] = sum;
+    }
+
+    memset(&frm, 0, offsetof(struct gs_host_frame, data) + sizeof(e->msg.data));
+    frm.echo_id = 0xFFFFFFFFU; /* no echo: the host did not send it */
+    frm.can_id = e->msg.can_id;
+    frm.can_dlc = e->msg.can_dlc;
+    frm.channel = channel;
+    frm.flags = e->msg.flags;
+    memcpy(frm.data, e->msg.data, len);
+    (void)gs_usb_tx_inject(channel, &frm, 1);
+}
+
+/* Alarm handler: send what is due, then re-arm for the earliest next entry. An entry that
+ * fell behind (queue full, bus-off) skips the missed periods but keeps its phase. */
+static void gs_cyclic_run(void) {
+    uint32_t now = gs_timer_now();
+    uint32_t next = 0;
+    uint8_t armed = 0;
+
+    for (uint8_t ch = 0; ch < NUM_CAN_CHANNELS; ch++) {
+        for (uint8_t i = 0; i < GS_CYCLIC_MAX_MSGS; i++) {
+            struct gs_cyclic_entry *e = &gs_cyclic[ch][i];
+            if (!e->active) {
+                continue;
+            }
+            if ((int32_t) (now - e->due_us) >= 0) {
+                gs_cyclic_send(ch, e);
+                uint32_t late = now - e->due_us;
+                e->due_us += (late / e->msg.period_us + 1U) * e->msg.period_us;
+            }
+            if (!armed || (int32_t) (e->due_us - next) < 0) {
+                next = e->due_us;
+                armed = 1;
+            }
+        }
+    }
+
+    if (armed) {
+        gs_timer_alarm_set(GS_TIMER_ALARM_CYCLIC, next);
+    } else {
+        gs_timer_alarm_stop(GS_TIMER_ALARM_CYCLIC);
+    }
+}
+
+void gs_cyclic_init(void) {
+    gs_timer_alarm_attach(GS_TIMER_ALARM_CYCLIC, gs_cyclic_run);
+}
+
+/* Store entry index; the schedule is recomputed right away */
+int gs_cyclic_set(uint8_t channel, uint16_t index, const uint8_t *data, uint16_t len) {
+    struct gs_cyclic_msg msg;
+    const uint16_t hdr = (uint16_t) offsetof(struct gs_cyclic_msg, data);
+
+    if (channel >= NUM_CAN_CHANNELS || index >= GS_CYCLIC_MAX_MSGS || data == NULL || len < hdr) {
+        return -1;
+    }
+    memset(&msg, 0, sizeof(msg));
+    memcpy(&msg, data, (len > sizeof(msg)) ? sizeof(msg) : len);
+
+    uint8_t max_dlc = (msg.flags & GS_CAN_FLAG_FD) ? 15U : 8U;
+    if (msg.can_dlc > max_dlc || gs_dlc_to_len[msg.can_dlc] > sizeof(msg.data) ||
+        len < hdr + gs_dlc_to_len[msg.can_dlc]) {
+        return -1;
+    }
+
+    struct gs_cyclic_entry *e = &gs_cyclic[channel][index];
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    e->msg = msg;
+    e->due_us = gs_timer_now() + msg.offset_us;
+    e->active = (msg.period_us != 0U) ? 1U : 0U;
+    __set_PRIMASK(primask);
+
+    gs_timer_alarm_set(GS_TIMER_ALARM_CYCLIC, gs_timer_now());
+    return 0;
+}
+
+void gs_cyclic_clear(uint8_t channel) {
+    if (channel >= NUM_CAN_CHANNELS) {
+        return;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    for (uint8_t i = 0; i < GS_CYCLIC_MAX_MSGS; i++) {
+        gs_cyclic[channel][i].active = 0;
+    }
+    __set_PRIMASK(primask);
+}
+
+/* Channel just started: phase offsets count from now */
+void gs_cyclic_restart(uint8_t channel) {
+    if (channel >= NUM_CAN_CHANNELS) {
+        return;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t now = gs_timer_now();
+    for (uint8_t i = 0; i < GS_CYCLIC_MAX_MSGS; i++) {
+        gs_cyclic[channel][i].due_us = now + gs_cyclic[channel][i].msg.offset_us;
+    }
+    __set_PRIMASK(primask);
+
+    gs_timer_alarm_set(GS_TIMER_ALARM_CYCLIC, gs_timer_now());
+}
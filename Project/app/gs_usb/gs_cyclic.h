@@ -0,0 +1,17 @@
+#ifndef __GS_CYCLIC_H__
+#define __GS_CYCLIC_H__
+#include <stdint.h>
+
+#include "gs_usb.h"
+
+/* Device-side periodic transmit table, driven by a device clock alarm so the period does not
+ * depend on USB or host scheduling */
+#ifndef GS_CYCLIC_MAX_MSGS
+#define GS_CYCLIC_MAX_MSGS 16
+#endif
+
+void gs_cyclic_init(void);
+int gs_cyclic_set(uint8_t channel, uint16_t index, const uint8_t *data, uint16_t len);
+void gs_cyclic_clear(uint8_t channel);
+void gs_cyclic_restart(uint8_t channel);
+#endif
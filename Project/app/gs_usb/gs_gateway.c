@@ -0,0 +1,121 @@
+#include "gs_gateway.h"
+
+#include <string.h>
+
+#define GS_GW_EFF_MASK 0x1FFFFFFFU
+#define GS_GW_SFF_MASK 0x7FFU
+
+static struct gs_gateway_route gs_gw_routes[NUM_CAN_CHANNELS][GS_GATEWAY_MAX_ROUTES];
+static uint8_t gs_gw_cnt[NUM_CAN_CHANNELS] = {0};
+
+static uint8_t gs_gateway_match(const struct gs_gateway_route *r, uint32_t can_id) {
+    if ((can_id ^ r->can_id) & CAN_EFF_FLAG) {
+        return 0;
+    }
+    uint32_t id_mask = (can_id & CAN_EFF_FLAG) ? GS_GW_EFF_MASK : GS_GW_SFF_MASK;
+    return (((can_id ^ r->can_id) & r->can_mask & id_mask) == 0U) ? 1U : 0U;
+}
+
+/* Apply a route to a copy of the received frame. Returns -1 when it cannot be sent in the
+ * requested format. */
+static int gs_gateway_rewrite(const struct gs_gateway_route *r, struct gs_host_frame *frm) {
+    if (r->flags & GS_GW_REWRITE) {
+        uint32_t can_id = (frm->can_id & ~r->new_mask) | (r->new_id & r->new_mask);
+        if (can_id & CAN_EFF_FLAG) {
+            can_id &= CAN_EFF_FLAG | CAN_RTR_FLAG | GS_GW_EFF_MASK;
+        } else {
+            can_id &= CAN_RTR_FLAG | GS_GW_SFF_MASK;
+        }
+        frm->can_id = can_id;
+    }
+
+    uint8_t fd = (frm->flags & GS_CAN_FLAG_FD) ? 1U : 0U;
+    uint8_t brs = (frm->flags & GS_CAN_FLAG_BRS) ? 1U : 0U;
+    if (!fd && frm->can_dlc > 8U) {
+        /* Classic DLC 9..15 still means 8 bytes */
+        frm->can_dlc = 8U;
+    }
+    if (r->flags & GS_GW_TO_CLASSIC) {
+        if (fd && frm->can_dlc > 8U) {
+            return -1;
+        }
+        fd = 0;
+    } else if ((r->flags & GS_GW_TO_FD) && (frm->can_id & CAN_RTR_FLAG) == 0U) {
+        fd = 1;
+        brs = (r->flags & GS_GW_BRS) ? 1U : 0U;
+    }
+    /* ESI reflects the sender's error state and is not forwarded */
+    frm->flags = fd ? (uint8_t) (GS_CAN_FLAG_FD | (brs ? GS_CAN_FLAG_BRS : 0U)) : 0U;
+    return 0;
+}
+
+/* Route one received element. Called from the source channel's RX interrupt with interrupts
+ * enabled: the table is only written from lower priority contexts, which cannot run until this
+ * returns. Returns 1 when the frame should still reach the host: no route matched, or a
+ * matching route mirrors it. */
+uint8_t gs_gateway_forward(uint8_t channel, const struct gs_mram_elem *elem) {
+    uint8_t cnt = gs_gw_cnt[channel];
+    if (cnt == 0U) {
+        return 1;
+    }
+
+    struct gs_host_frame frm;
+    struct gs_host_frame out;
+    uint8_t matched = 0;
+    uint8_t deliver = 0;
+
+    gs_mram_rx_to_frame(elem, &frm);
+    frm.reserved = 0;
+    for (uint8_t i = 0; i < cnt; i++) {
+        const struct gs_gateway_route *r = &gs_gw_routes[channel][i];
+        if (!gs_gateway_match(r, frm.can_id)) {
+            continue;
+        }
+        matched = 1;
+        if (r->flags & GS_GW_MIRROR) {
+            deliver = 1;
+        }
+        memcpy(&out, &frm, sizeof(out));
+        if (gs_gateway_rewrite(r, &out) != 0) {
+            continue;
+        }
+        out.channel = r->dst_channel;
+        gs_usb_gateway_send(r->dst_channel, &out);
+    }
+    return matched ? deliver : 1U;
+}
+
+/* Store routes starting at index first; first == 0 replaces the whole table, otherwise the
+ * routes past the new ones are kept */
+int gs_gateway_set(uint8_t channel, uint16_t first, const uint8_t *data, uint16_t len) {
+    uint16_t n = len / sizeof(struct gs_gateway_route);
+    if (channel >= NUM_CAN_CHANNELS || data == NULL || n == 0U || first > gs_gw_cnt[channel] ||
+        first + n > GS_GATEWAY_MAX_ROUTES) {
+        return -1;
+    }
+
+    struct gs_gateway_route tmp[GS_GATEWAY_MAX_ROUTES];
+    memcpy(tmp, data, n * sizeof(tmp[0]));
+    for (uint16_t i = 0; i < n; i++) {
+        if (tmp[i].dst_channel >= NUM_CAN_CHANNELS || tmp[i].dst_channel == channel ||
+            (tmp[i].flags & (GS_GW_TO_FD | GS_GW_TO_CLASSIC)) == (GS_GW_TO_FD | GS_GW_TO_CLASSIC)) {
+            return -1;
+        }
+    }
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memcpy(&gs_gw_routes[channel][first], tmp, n * sizeof(tmp[0]));
+    if (first == 0U || first + n > gs_gw_cnt[channel]) {
+        gs_gw_cnt[channel] = (uint8_t) (first + n);
+    }
+    __set_PRIMASK(primask);
+    return 0;
+}
+
+void gs_gateway_clear(uint8_t channel) {
+    if (channel >= NUM_CAN_CHANNELS) {
+        return;
+    }
+    gs_gw_cnt[channel] = 0;
+}
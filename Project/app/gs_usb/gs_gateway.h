@@ -0,0 +1,17 @@
+#ifndef __GS_GATEWAY_H__
+#define __GS_GATEWAY_H__
+#include <stdint.h>
+
+#include "gs_mram.h"
+#include "gs_usb.h"
+
+/* On-device CAN-to-CAN routing: received frames are matched and sent on another channel from
+ * the RX interrupt, without a round trip through the host */
+#ifndef GS_GATEWAY_MAX_ROUTES
+#define GS_GATEWAY_MAX_ROUTES 16
+#endif
+
+int gs_gateway_set(uint8_t channel, uint16_t first, const uint8_t *data, uint16_t len);
+void gs_gateway_clear(uint8_t channel);
+uint8_t gs_gateway_forward(uint8_t channel, const struct gs_mram_elem *elem);
+#endif
@@ -0,0 +1,220 @@
+#include "gs_mram.h"
+
+#include <string.h>
+
+/* Element header bits, shared by RX, TX and TX event elements */
+#define GS_MRAM_ESI 0x80000000U
+#define GS_MRAM_XTD 0x40000000U
+#define GS_MRAM_RTR 0x20000000U
+#define GS_MRAM_EXTID 0x1FFFFFFFU
+#define GS_MRAM_STDID_POS 18U
+#define GS_MRAM_EFC 0x00800000U
+#define GS_MRAM_FDF 0x00200000U
+#define GS_MRAM_BRS 0x00100000U
+#define GS_MRAM_DLC_POS 16U
+#define GS_MRAM_MM_POS 24U
+
+/* Fixed G0 layout: RX and TX elements are 18 words, TX events 2 */
+#define GS_MRAM_ELEM_SIZE (18U * 4U)
+#define GS_MRAM_TEF_SIZE (2U * 4U)
+
+const uint8_t gs_dlc_to_len[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+/* Payload bytes carried by an element: classic frames cap at 8 whatever the DLC */
+static inline uint8_t gs_mram_payload_len(uint32_t r1) {
+    uint8_t len = gs_dlc_to_len[(r1 >> GS_MRAM_DLC_POS) & 0xFU];
+    if ((r1 & GS_MRAM_FDF) == 0U && len > 8U) {
+        len = 8U;
+    }
+    return len;
+}
+
+uint32_t gs_mram_rx_level(const FDCAN_HandleTypeDef *hfdcan, uint32_t fifo) {
+    if (fifo == FDCAN_RX_FIFO0) {
+        return hfdcan->Instance->RXF0S & FDCAN_RXF0S_F0FL;
+    }
+    return hfdcan->Instance->RXF1S & FDCAN_RXF1S_F1FL;
+}
+
+/* Pop the oldest element of an RX FIFO. The FIFOs run in blocking mode, so the get index
+ * always names the oldest element. */
+int gs_mram_rx_read(FDCAN_HandleTypeDef *hfdcan, uint32_t fifo, struct gs_mram_elem *elem) {
+#if GS_MRAM_USE_HAL
+    FDCAN_RxHeaderTypeDef hdr;
+    if (HAL_FDCAN_GetRxMessage(hfdcan, fifo, &hdr, (uint8_t *) elem->data) != HAL_OK) {
+        return -1;
+    }
+    elem->r0 = hdr.ErrorStateIndicator | hdr.IdType | hdr.RxFrameType |
+               ((hdr.IdType == FDCAN_EXTENDED_ID) ? hdr.Identifier : (hdr.Identifier << GS_MRAM_STDID_POS));
+    elem->r1 = hdr.FDFormat | hdr.BitRateSwitch | (hdr.DataLength << GS_MRAM_DLC_POS);
+    return 0;
+#else
+    uint32_t status;
+    uint32_t base;
+    if (fifo == FDCAN_RX_FIFO0) {
+        status = hfdcan->Instance->RXF0S;
+        base = hfdcan->msgRam.RxFIFO0SA;
+    } else {
+        status = hfdcan->Instance->RXF1S;
+        base = hfdcan->msgRam.RxFIFO1SA;
+    }
+    /* F0FL/F0GI and F1FL/F1GI sit at the same positions */
+    if ((status & FDCAN_RXF0S_F0FL) == 0U) {
+        return -1;
+    }
+
+    uint32_t idx = (status & FDCAN_RXF0S_F0GI) >> FDCAN_RXF0S_F0GI_Pos;
+    const volatile uint32_t *src = (const volatile uint32_t *) (base + idx * GS_MRAM_ELEM_SIZE);
+    elem->r0 = src[0];
+    elem->r1 = src[1];
+    uint32_t words = ((uint32_t) gs_mram_payload_len(elem->r1) + 3U) >> 2;
+    for (uint32_t i = 0; i < words; i++) {
+        elem->data[i] = src[2U + i];
+    }
+
+    if (fifo == FDCAN_RX_FIFO0) {
+        hfdcan->Instance->RXF0A = idx;
+    } else {
+        hfdcan->Instance->RXF1A = idx;
+    }
+    return 0;
+#endif
+}
+
+/* Header words to SocketCAN id/flags; the data area past the payload is zeroed */
+void gs_mram_rx_to_frame(const struct gs_mram_elem *elem, struct gs_host_frame *frm) {
+    uint32_t r0 = elem->r0;
+    uint32_t r1 = elem->r1;
+    uint32_t can_id;
+
+    if (r0 & GS_MRAM_XTD) {
+        can_id = (r0 & GS_MRAM_EXTID) | CAN_EFF_FLAG;
+    } else {
+        can_id = (r0 >> GS_MRAM_STDID_POS) & 0x7FFU;
+    }
+    if (r0 & GS_MRAM_RTR) {
+        can_id |= CAN_RTR_FLAG;
+    }
+
+    uint8_t flags = 0;
+    if (r1 & GS_MRAM_FDF) {
+        flags |= GS_CAN_FLAG_FD;
+        if (r1 & GS_MRAM_BRS) {
+            flags |= GS_CAN_FLAG_BRS;
+        }
+        if (r0 & GS_MRAM_ESI) {
+            flags |= GS_CAN_FLAG_ESI;
+        }
+    }
+
+    frm->echo_id = 0xFFFFFFFFU;
+    frm->can_id = can_id;
+    frm->can_dlc = (uint8_t) ((r1 >> GS_MRAM_DLC_POS) & 0xFU);
+    frm->flags = flags;
+
+    uint8_t len = gs_mram_payload_len(r1);
+    uint8_t area = (flags & GS_CAN_FLAG_FD) ? 64U : 8U;
+    memcpy(frm->data, elem->data, len);
+    if (len < area) {
+        memset(&frm->data[len], 0, area - len);
+    }
+}
+
+/* Queue a host frame in the TX FIFO; marker comes back in the TX event. Returns the TX
+ * buffer index used, -1 when full. */
+int gs_mram_tx_put(FDCAN_HandleTypeDef *hfdcan, const struct gs_host_frame *frm, uint8_t marker) {
+    uint32_t can_id = frm->can_id;
+    uint8_t is_fd = (frm->flags & GS_CAN_FLAG_FD) ? 1U : 0U;
+    /* can_dlc is a DLC code; classic frames only go up to 8 */
+    uint32_t dlc = frm->can_dlc;
+    if (dlc > (is_fd ? 15U : 8U)) {
+        dlc = is_fd ? 15U : 8U;
+    }
+
+#if GS_MRAM_USE_HAL
+    FDCAN_TxHeaderTypeDef tx = {0};
+    tx.IdType = (can_id & CAN_EFF_FLAG) ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
+    tx.Identifier = (can_id & CAN_EFF_FLAG) ? (can_id & 0x1FFFFFFFU) : (can_id & 0x7FFU);
+    tx.TxFrameType = (can_id & CAN_RTR_FLAG) ? FDCAN_REMOTE_FRAME : FDCAN_DATA_FRAME;
+    tx.DataLength = dlc;
+    tx.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
+    tx.BitRateSwitch = (is_fd && (frm->flags & GS_CAN_FLAG_BRS)) ? FDCAN_BRS_ON : FDCAN_BRS_OFF;
+    tx.FDFormat = is_fd ? FDCAN_FD_CAN : FDCAN_CLASSIC_CAN;
+    tx.TxEventFifoControl = FDCAN_STORE_TX_EVENTS;
+    tx.MessageMarker = marker;
+    if (HAL_FDCAN_AddMessageToTxFifoQ(hfdcan, &tx, frm->data) != HAL_OK) {
+        return -1;
+    }
+    return (int) (31U - __CLZ(HAL_FDCAN_GetLatestTxFifoQRequestBuffer(hfdcan)));
+#else
+    uint32_t status = hfdcan->Instance->TXFQS;
+    if (status & FDCAN_TXFQS_TFQF) {
+        return -1;
+    }
+
+    uint32_t t0;
+    if (can_id & CAN_EFF_FLAG) {
+        t0 = GS_MRAM_XTD | (can_id & GS_MRAM_EXTID);
+    } else {
+        t0 = (can_id & 0x7FFU) << GS_MRAM_STDID_POS;
+    }
+    if (can_id & CAN_RTR_FLAG) {
+        t0 |= GS_MRAM_RTR;
+    }
+
+    uint32_t t1 = ((uint32_t) marker << GS_MRAM_MM_POS) | GS_MRAM_EFC | (dlc << GS_MRAM_DLC_POS);
+    if (is_fd) {
+        t1 |= GS_MRAM_FDF;
+        if (frm->flags & GS_CAN_FLAG_BRS) {
+            t1 |= GS_MRAM_BRS;
+        }
+    }
+
+    uint32_t idx = (status & FDCAN_TXFQS_TFQPI) >> FDCAN_TXFQS_TFQPI_Pos;
+    volatile uint32_t *dst = (volatile uint32_t *) (hfdcan->msgRam.TxFIFOQSA + idx * GS_MRAM_ELEM_SIZE);
+    dst[0] = t0;
+    dst[1] = t1;
+
+    uint32_t words = ((uint32_t) gs_dlc_to_len[dlc] + 3U) >> 2;
+    const uint8_t *src = frm->data;
+    if (((uintptr_t) src & 3U) == 0U) {
+        const uint32_t *src32 = (const uint32_t *) src;
+        for (uint32_t i = 0; i < words; i++) {
+            dst[2U + i] = src32[i];
+        }
+    } else {
+        for (uint32_t i = 0; i < words; i++) {
+            uint32_t w;
+            memcpy(&w, &src[i * 4U], sizeof(w));
+            dst[2U + i] = w;
+        }
+    }
+
+    hfdcan->LatestTxFifoQRequest = 1UL << idx;
+    hfdcan->Instance->TXBAR = 1UL << idx;
+    return (int) idx;
+#endif
+}
+
+/* Pop the oldest TX event and return its message marker. -1 when the FIFO is empty. */
+int gs_mram_tx_event_get(FDCAN_HandleTypeDef *hfdcan, uint8_t *marker) {
+#if GS_MRAM_USE_HAL
+    FDCAN_TxEventFifoTypeDef evt;
+    if ((hfdcan->Instance->TXEFS & FDCAN_TXEFS_EFFL) == 0U || HAL_FDCAN_GetTxEvent(hfdcan, &evt) != HAL_OK) {
+        return -1;
+    }
+    *marker = (uint8_t) evt.MessageMarker;
+    return 0;
+#else
+    uint32_t status = hfdcan->Instance->TXEFS;
+    if ((status & FDCAN_TXEFS_EFFL) == 0U) {
+        return -1;
+    }
+
+    uint32_t idx = (status & FDCAN_TXEFS_EFGI) >> FDCAN_TXEFS_EFGI_Pos;
+    const volatile uint32_t *src = (const volatile uint32_t *) (hfdcan->msgRam.TxEventFIFOSA + idx * GS_MRAM_TEF_SIZE);
+    *marker = (uint8_t) (src[1] >> GS_MRAM_MM_POS);
+    hfdcan->Instance->TXEFA = idx;
+    return 0;
+#endif
+}
@@ -0,0 +1,28 @@
+#ifndef __GS_MRAM_H__
+#define __GS_MRAM_H__
+#include <stdint.h>
+
+#include "fdcan.h"
+#include "gs_usb.h"
+
+/* Hot-path FDCAN message RAM access: elements are moved as raw words and converted straight
+ * to/from gs_host_frame. Build with GS_MRAM_USE_HAL=1 to go through the HAL instead. */
+#ifndef GS_MRAM_USE_HAL
+#define GS_MRAM_USE_HAL 0
+#endif
+
+/* RX/TX element as laid out in message RAM: two header words and up to 64 data bytes */
+struct gs_mram_elem {
+    uint32_t r0; /* ESI | XTD | RTR | ID */
+    uint32_t r1; /* FDF | BRS | DLC | ... */
+    uint32_t data[16];
+};
+
+extern const uint8_t gs_dlc_to_len[16];
+
+uint32_t gs_mram_rx_level(const FDCAN_HandleTypeDef *hfdcan, uint32_t fifo);
+int gs_mram_rx_read(FDCAN_HandleTypeDef *hfdcan, uint32_t fifo, struct gs_mram_elem *elem);
+void gs_mram_rx_to_frame(const struct gs_mram_elem *elem, struct gs_host_frame *frm);
+int gs_mram_tx_put(FDCAN_HandleTypeDef *hfdcan, const struct gs_host_frame *frm, uint8_t marker);
+int gs_mram_tx_event_get(FDCAN_HandleTypeDef *hfdcan, uint8_t *marker);
+#endif
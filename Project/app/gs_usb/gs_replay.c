@@ -0,0 +1,129 @@
+#include "gs_replay.h"
+
+#include <string.h>
+
+#include "gs_timer.h"
+
+/* Frames stay in their slot; the order ring holds slot indices sorted by release time.
+ * Traces arrive mostly in time order, so an insert normally lands at the head without moving
+ * anything. */
+struct gs_replay_queue {
+    struct gs_host_frame frm[GS_REPLAY_QUEUE_LEN];
+    uint32_t at[GS_REPLAY_QUEUE_LEN];
+    uint16_t order[GS_REPLAY_QUEUE_LEN];
+    uint16_t free[GS_REPLAY_QUEUE_LEN]; /* stack of unused slots */
+    uint16_t free_top;
+    volatile uint16_t head;
+    volatile uint16_t tail;
+};
+
+static struct gs_replay_queue gs_replay __attribute__((aligned(4)));
+
+#define GS_REPLAY_MASK (GS_REPLAY_QUEUE_LEN - 1U)
+
+/* Re-arm for the earliest queued frame. Interrupts masked. */
+static void gs_replay_arm(void) {
+    if (gs_replay.tail == gs_replay.head) {
+        gs_timer_alarm_stop(GS_TIMER_ALARM_REPLAY);
+        return;
+    }
+    gs_timer_alarm_set(GS_TIMER_ALARM_REPLAY, gs_replay.at[gs_replay.order[gs_replay.tail & GS_REPLAY_MASK]]);
+}
+
+/* Alarm handler: release every frame that is due. Released frames go ahead of queued host
+ * traffic and straight into the TX FIFO when it has room; only frames already in the
+ * hardware FIFO (at most 3) can still delay them. A frame for a stopped channel is dropped;
+ * one whose channel queue is full is retried shortly. */
+static void gs_replay_run(void) {
+    for (;;) {
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        if (gs_replay.tail == gs_replay.head) {
+            gs_timer_alarm_stop(GS_TIMER_ALARM_REPLAY);
+            __set_PRIMASK(primask);
+            return;
+        }
+        uint16_t slot = gs_replay.order[gs_replay.tail & GS_REPLAY_MASK];
+        uint32_t now = gs_timer_now();
+        if ((int32_t) (now - gs_replay.at[slot]) < 0) {
+            gs_timer_alarm_set(GS_TIMER_ALARM_REPLAY, gs_replay.at[slot]);
+            __set_PRIMASK(primask);
+            return;
+        }
+        if (gs_usb_tx_inject(gs_replay.frm[slot].channel, &gs_replay.frm[slot], 1) == -2) {
+            gs_timer_alarm_set(GS_TIMER_ALARM_REPLAY, now + GS_REPLAY_RETRY_US);
+            __set_PRIMASK(primask);
+            return;
+        }
+        gs_replay.tail = (uint16_t) (gs_replay.tail + 1U);
+        gs_replay.free[gs_replay.free_top++] = slot;
+        __set_PRIMASK(primask);
+    }
+}
+
+void gs_replay_init(void) {
+    for (uint16_t i = 0; i < GS_REPLAY_QUEUE_LEN; i++) {
+        gs_replay.free[i] = (uint16_t) (GS_REPLAY_QUEUE_LEN - 1U - i);
+    }
+    gs_replay.free_top = GS_REPLAY_QUEUE_LEN;
+    gs_timer_alarm_attach(GS_TIMER_ALARM_REPLAY, gs_replay_run);
+}
+
+uint16_t gs_replay_room(void) {
+    return (uint16_t) (GS_REPLAY_QUEUE_LEN - (uint16_t) (gs_replay.head - gs_replay.tail));
+}
+
+/* Called from the EP1 OUT handler. Frames with equal release times keep their arrival order.
+ * -1 when the queue is full. */
+int gs_replay_push(const struct gs_host_frame *frm, uint32_t at) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (gs_replay.free_top == 0U) {
+        __set_PRIMASK(primask);
+        return -1;
+    }
+    uint16_t slot = gs_replay.free[--gs_replay.free_top];
+    __set_PRIMASK(primask);
+
+    /* The slot is ours until it is linked, so the copy runs unmasked */
+    memcpy(&gs_replay.frm[slot], frm, sizeof(struct gs_host_frame));
+    gs_replay.frm[slot].flags &= (uint8_t) ~GS_CAN_FLAG_TX_AT;
+    gs_replay.at[slot] = at;
+
+    primask = __get_PRIMASK();
+    __disable_irq();
+    uint16_t pos = gs_replay.head;
+    while (pos != gs_replay.tail) {
+        uint16_t prev = gs_replay.order[(uint16_t) (pos - 1U) & GS_REPLAY_MASK];
+        if ((int32_t) (gs_replay.at[prev] - at) <= 0) {
+            break;
+        }
+        gs_replay.order[pos & GS_REPLAY_MASK] = prev;
+        pos--;
+    }
+    gs_replay.order[pos & GS_REPLAY_MASK] = slot;
+    gs_replay.head = (uint16_t) (gs_replay.head + 1U);
+    if (pos == gs_replay.tail) {
+        gs_replay_arm();
+    }
+    __set_PRIMASK(primask);
+    return 0;
+}
+
+/* Drop every pending frame of a channel, e.g. on reset */
+void gs_replay_flush(uint8_t channel) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint16_t keep = gs_replay.tail;
+    for (uint16_t pos = gs_replay.tail; pos != gs_replay.head; pos++) {
+        uint16_t slot = gs_replay.order[pos & GS_REPLAY_MASK];
+        if (gs_replay.frm[slot].channel == channel) {
+            gs_replay.free[gs_replay.free_top++] = slot;
+        } else {
+            gs_replay.order[keep++ & GS_REPLAY_MASK] = slot;
+        }
+    }
+    gs_replay.head = keep;
+    gs_replay_arm();
+    __set_PRIMASK(primask);
+}
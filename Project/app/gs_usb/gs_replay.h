@@ -0,0 +1,25 @@
+#ifndef __GS_REPLAY_H__
+#define __GS_REPLAY_H__
+#include <stdint.h>
+
+#include "gs_usb.h"
+
+/* Host frames tagged with GS_CAN_FLAG_TX_AT wait here, ordered by their release time, and are
+ * handed to the TX queue from a device clock alarm. Shared by all channels. */
+#ifndef GS_REPLAY_QUEUE_LEN
+#define GS_REPLAY_QUEUE_LEN 512
+#endif
+#if (GS_REPLAY_QUEUE_LEN & (GS_REPLAY_QUEUE_LEN - 1)) != 0 || GS_REPLAY_QUEUE_LEN > 0x8000
+#error "GS_REPLAY_QUEUE_LEN must be a power of two, at most 0x8000"
+#endif
+
+/* Retry interval while the target channel's TX queue is full */
+#ifndef GS_REPLAY_RETRY_US
+#define GS_REPLAY_RETRY_US 50U
+#endif
+
+void gs_replay_init(void);
+int gs_replay_push(const struct gs_host_frame *frm, uint32_t at);
+uint16_t gs_replay_room(void);
+void gs_replay_flush(uint8_t channel);
+#endif
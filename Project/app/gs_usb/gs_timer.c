@@ -0,0 +1,74 @@
+#include "gs_timer.h"
+
+/* CCxIE, CCxIF and CCxG all sit at bit x */
+#define GS_TIMER_ALARM_BIT(alarm) (1UL << (alarm))
+#define GS_TIMER_ALARM_MASK (TIM_DIER_CC1IE | TIM_DIER_CC2IE | TIM_DIER_CC3IE | TIM_DIER_CC4IE)
+
+static gs_timer_alarm_fn gs_timer_alarm_fns[GS_TIMER_ALARM_NUM];
+
+void gs_timer_init(void) {
+    __HAL_RCC_TIM2_CLK_ENABLE();
+
+    /* Timer kernel clock is PCLK, doubled when the APB prescaler is not 1 */
+    uint32_t clk = HAL_RCC_GetPCLK1Freq();
+    if ((RCC->CFGR & RCC_CFGR_PPRE) != RCC_HCLK_DIV1) {
+        clk *= 2U;
+    }
+
+    GS_TIMER_INSTANCE->CR1 = 0;
+    GS_TIMER_INSTANCE->PSC = (clk / GS_TIMER_HZ) - 1U;
+    GS_TIMER_INSTANCE->ARR = 0xFFFFFFFFU;
+    GS_TIMER_INSTANCE->CNT = 0;
+    /* Frozen output compare: a match only sets CCxIF */
+    GS_TIMER_INSTANCE->CCMR1 = 0;
+    GS_TIMER_INSTANCE->CCMR2 = 0;
+    GS_TIMER_INSTANCE->DIER = 0;
+    /* Load PSC now rather than at the first overflow */
+    GS_TIMER_INSTANCE->EGR = TIM_EGR_UG;
+    GS_TIMER_INSTANCE->SR = 0;
+    GS_TIMER_INSTANCE->CR1 = TIM_CR1_CEN;
+
+    HAL_NVIC_SetPriority(TIM2_IRQn, GS_TIMER_IRQ_PRIORITY, 0);
+    HAL_NVIC_EnableIRQ(TIM2_IRQn);
+}
+
+void gs_timer_alarm_attach(uint8_t alarm, gs_timer_alarm_fn fn) {
+    if (alarm >= 1U && alarm <= GS_TIMER_ALARM_NUM) {
+        gs_timer_alarm_fns[alarm - 1U] = fn;
+    }
+}
+
+/* Fire once when the clock reaches at. The compare only matches on the exact count, so an
+ * alarm that is already due is raised by software instead. */
+void gs_timer_alarm_set(uint8_t alarm, uint32_t at) {
+    uint32_t bit = GS_TIMER_ALARM_BIT(alarm);
+    volatile uint32_t *ccr = &GS_TIMER_INSTANCE->CCR1 + (alarm - 1U);
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    *ccr = at;
+    GS_TIMER_INSTANCE->SR = ~bit;
+    GS_TIMER_INSTANCE->DIER |= bit;
+    if ((int32_t) (gs_timer_now() - at) >= 0) {
+        GS_TIMER_INSTANCE->EGR = bit;
+    }
+    __set_PRIMASK(primask);
+}
+
+void gs_timer_alarm_stop(uint8_t alarm) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    GS_TIMER_INSTANCE->DIER &= ~GS_TIMER_ALARM_BIT(alarm);
+    GS_TIMER_INSTANCE->SR = ~GS_TIMER_ALARM_BIT(alarm);
+    __set_PRIMASK(primask);
+}
+
+void gs_timer_irq_handler(void) {
+    uint32_t sr = GS_TIMER_INSTANCE->SR & GS_TIMER_INSTANCE->DIER & GS_TIMER_ALARM_MASK;
+    GS_TIMER_INSTANCE->SR = ~sr;
+    for (uint8_t alarm = 1U; alarm <= GS_TIMER_ALARM_NUM; alarm++) {
+        if ((sr & GS_TIMER_ALARM_BIT(alarm)) && gs_timer_alarm_fns[alarm - 1U] != NULL) {
+            gs_timer_alarm_fns[alarm - 1U]();
+        }
+    }
+}
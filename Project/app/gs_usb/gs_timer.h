@@ -0,0 +1,31 @@
+#ifndef __GS_TIMER_H__
+#define __GS_TIMER_H__
+#include <stdint.h>
+
+#include "stm32g0xx_hal.h"
+
+/* 1 MHz free-running device clock on the 32-bit TIM2, shared by RX/TX timestamps */
+#define GS_TIMER_INSTANCE TIM2
+#define GS_TIMER_HZ 1000000U
+
+/* The four compare channels double as one-shot alarms on the same time base */
+#define GS_TIMER_ALARM_CYCLIC 1U
+#define GS_TIMER_ALARM_REPLAY 2U
+#define GS_TIMER_ALARM_NUM 4U
+
+#ifndef GS_TIMER_IRQ_PRIORITY
+#define GS_TIMER_IRQ_PRIORITY 1
+#endif
+
+typedef void (*gs_timer_alarm_fn)(void);
+
+void gs_timer_init(void);
+void gs_timer_alarm_attach(uint8_t alarm, gs_timer_alarm_fn fn);
+void gs_timer_alarm_set(uint8_t alarm, uint32_t at);
+void gs_timer_alarm_stop(uint8_t alarm);
+void gs_timer_irq_handler(void);
+
+static inline uint32_t gs_timer_now(void) {
+    return GS_TIMER_INSTANCE->CNT;
+}
+#endif
@@ -1,10 +1,18 @@
 #include "gs_usb.h"
 
 #include "fdcan.h"
+#include "gs_cyclic.h"
+#include "gs_gateway.h"
+#include "gs_mram.h"
+#include "gs_replay.h"
+#include "gs_timer.h"
+#include <stddef.h>
 #include <string.h>
 
 #include "usb_core.h"// 你自己的 EP0 API
 
+_Static_assert(sizeof(struct gs_host_frame) <= USB_EP1_TX_SLOT_SIZE, "gs_host_frame does not fit an EP1 IN slot");
+
 /* ================= Device capability ================= */
 /**
  * struct gs_device_config - Configuration describing the gs_usb compatible device
@@ -24,11 +32,14 @@ static const struct gs_usb_device_config gs_dev_cfg = {
 
 /* ================= Bit timing capability ================= */
 
+/* fclk_can is filled in from the live RCC configuration when the host asks. FDCAN samples
+ * each bit once, so triple sampling is not offered. */
+
 static const struct gs_usb_bittiming_const gs_bt_const = {
-    .feature = GS_CAN_FEATURE_LISTEN_ONLY | GS_CAN_FEATURE_LOOP_BACK | GS_CAN_FEATURE_TRIPLE_SAMPLE |
-               GS_CAN_FEATURE_ONE_SHOT | GS_CAN_FEATURE_BERR_REPORTING | GS_CAN_FEATURE_FD |
+    .feature = GS_CAN_FEATURE_LISTEN_ONLY | GS_CAN_FEATURE_LOOP_BACK | GS_CAN_FEATURE_ONE_SHOT |
+               GS_CAN_FEATURE_HW_TIMESTAMP | GS_CAN_FEATURE_BERR_REPORTING | GS_CAN_FEATURE_FD |
                GS_CAN_FEATURE_BT_CONST_EXT,
-    .fclk_can = 60000000,
+    .fclk_can = 0,
     .tseg1_min = 1,
     .tseg1_max = 256,
     .tseg2_min = 1,
@@ -40,10 +51,10 @@ static const struct gs_usb_bittiming_const gs_bt_const = {
 };
 
 static const struct gs_device_bt_const_extended gs_bt_const_ext = {
-    .feature = GS_CAN_FEATURE_LISTEN_ONLY | GS_CAN_FEATURE_LOOP_BACK | GS_CAN_FEATURE_TRIPLE_SAMPLE |
-               GS_CAN_FEATURE_ONE_SHOT | GS_CAN_FEATURE_BERR_REPORTING | GS_CAN_FEATURE_FD |
+    .feature = GS_CAN_FEATURE_LISTEN_ONLY | GS_CAN_FEATURE_LOOP_BACK | GS_CAN_FEATURE_ONE_SHOT |
+               GS_CAN_FEATURE_HW_TIMESTAMP | GS_CAN_FEATURE_BERR_REPORTING | GS_CAN_FEATURE_FD |
                GS_CAN_FEATURE_BT_CONST_EXT,
-    .fclk_can = 60000000,
+    .fclk_can = 0,
     .tseg1_min = 1,
     .tseg1_max = 256,
     .tseg2_min = 1,
@@ -62,10 +73,189 @@ static const struct gs_device_bt_const_extended gs_bt_const_ext = {
     .dbrp_inc = 1,
 };
 
+/* Raw RX queues: filled by the FDCAN interrupts, drained by gs_usb_poll() in the main loop.
+ * The two channel interrupts may preempt each other, so a push is one short critical section;
+ * the consumer side needs no locking.
+ * The high priority queue carries RX FIFO1 traffic and is always drained first. */
+#ifndef GS_USB_RX_QUEUE_LEN
+#define GS_USB_RX_QUEUE_LEN 64
+#endif
+#ifndef GS_USB_RX_HI_QUEUE_LEN
+#define GS_USB_RX_HI_QUEUE_LEN 16
+#endif
+#if (GS_USB_RX_QUEUE_LEN & (GS_USB_RX_QUEUE_LEN - 1)) != 0 || (GS_USB_RX_HI_QUEUE_LEN & (GS_USB_RX_HI_QUEUE_LEN - 1)) != 0
+#error "GS_USB_RX_QUEUE_LEN and GS_USB_RX_HI_QUEUE_LEN must be powers of two"
+#endif
+
+struct gs_rx_elem {
+    struct gs_mram_elem raw;
+    uint32_t timestamp_us;
+    uint8_t channel;
+};
+
+struct gs_rx_queue {
+    struct gs_rx_elem *elem;
+    uint16_t mask;
+    volatile uint16_t head;
+    volatile uint16_t tail;
+    volatile uint32_t overflow;
+};
+
+static struct gs_rx_elem gs_rx_lo_elem[GS_USB_RX_QUEUE_LEN];
+static struct gs_rx_elem gs_rx_hi_elem[GS_USB_RX_HI_QUEUE_LEN];
+static struct gs_rx_queue gs_rx_lo = {.elem = gs_rx_lo_elem, .mask = GS_USB_RX_QUEUE_LEN - 1};
+static struct gs_rx_queue gs_rx_hi = {.elem = gs_rx_hi_elem, .mask = GS_USB_RX_HI_QUEUE_LEN - 1};
+static volatile uint32_t gs_rx_fifo_lost[NUM_CAN_CHANNELS] = {0};
+
+/* Every interrupt group of a channel goes to that channel's own line */
+#define GS_USB_FDCAN_IT_GROUPS                                                                                      \
+    (FDCAN_IT_GROUP_RX_FIFO0 | FDCAN_IT_GROUP_RX_FIFO1 | FDCAN_IT_GROUP_SMSG | FDCAN_IT_GROUP_TX_FIFO_ERROR |      \
+     FDCAN_IT_GROUP_MISC | FDCAN_IT_GROUP_BIT_LINE_ERROR | FDCAN_IT_GROUP_PROTOCOL_ERROR)
+
+#define GS_USB_RX_FIFO0_ITS (FDCAN_IT_RX_FIFO0_NEW_MESSAGE | FDCAN_IT_RX_FIFO0_FULL | FDCAN_IT_RX_FIFO0_MESSAGE_LOST)
+#define GS_USB_RX_FIFO1_ITS (FDCAN_IT_RX_FIFO1_NEW_MESSAGE | FDCAN_IT_RX_FIFO1_FULL | FDCAN_IT_RX_FIFO1_MESSAGE_LOST)
+#define GS_USB_ERR_ITS (FDCAN_IT_ERROR_WARNING | FDCAN_IT_ERROR_PASSIVE | FDCAN_IT_BUS_OFF)
+#define GS_USB_BERR_ITS (FDCAN_IT_ARB_PROTOCOL_ERROR | FDCAN_IT_DATA_PROTOCOL_ERROR)
+
+/* Error reporting: FDCAN interrupts record what happened and the main loop folds it into at
+ * most one CAN_ERR_FLAG frame per channel and interval. Protocol error interrupts stay
+ * disabled from the first error until that frame has gone out, so a storm costs one
+ * interrupt per interval. */
+#ifndef GS_USB_ERR_INTERVAL_US
+#define GS_USB_ERR_INTERVAL_US 10000U
+#endif
+
+struct gs_can_err {
+    volatile uint8_t state;   /* GS_CAN_STATE_* from the last PSR read */
+    volatile uint8_t prot;    /* CAN_ERR_PROT_* seen since the last error frame */
+    volatile uint8_t loc;     /* CAN_ERR_PROT_LOC_* */
+    volatile uint8_t ack;     /* no ACK for a transmitted frame */
+    volatile uint8_t pending;
+    uint8_t restarted;        /* left bus-off through automatic recovery */
+    uint8_t tx_timeout;       /* a frame was cancelled at its deadline */
+    uint8_t reported;         /* state in the last error frame */
+    uint8_t berr;             /* bus error reporting on for the running session */
+    uint8_t berr_req;         /* set by GS_USB_BREQ_BERR, kept across sessions */
+    uint32_t last_us;
+};
+static struct gs_can_err gs_err[NUM_CAN_CHANNELS];
+
+/* Bus-off recovery, run from the main loop */
+struct gs_can_busoff {
+    struct gs_busoff_policy policy;
+    uint32_t delay_us;  /* current back-off */
+    uint32_t since_us;  /* bus-off seen, or restart completed */
+    uint8_t waiting;    /* bus-off, restart not issued yet */
+    uint8_t restarting; /* INIT cleared, waiting for 128 x 11 recessive bits */
+};
+static struct gs_can_busoff gs_busoff[NUM_CAN_CHANNELS];
+
+/* Priority ID set per channel, applied on the next GS_CAN_MODE_START */
+static struct gs_prio_filter gs_prio_filters[NUM_CAN_CHANNELS][GS_USB_MAX_PRIO_FILTERS];
+static uint8_t gs_prio_filter_cnt[NUM_CAN_CHANNELS] = {0};
+
+/* Host acceptance filters per channel; empty means accept everything */
+static struct gs_device_filter gs_filters[NUM_CAN_CHANNELS][GS_USB_MAX_FILTERS];
+static uint8_t gs_filter_cnt[NUM_CAN_CHANNELS] = {0};
+
+/* Frames handed to the FDCAN wait here for their TX event. The slot index travels as the
+ * MessageMarker, so the echo goes out only once the frame is actually on the wire. */
+#ifndef GS_USB_TX_ECHO_SLOTS
+#define GS_USB_TX_ECHO_SLOTS 8
+#endif
+#if GS_USB_TX_ECHO_SLOTS > 32
+#error "GS_USB_TX_ECHO_SLOTS must fit the 32-bit slot mask"
+#endif
+/* Marker of frames sent without an echo slot (gateway) */
+#define GS_USB_TX_MARKER_NONE 0xFFU
+#define GS_USB_TX_DONE_LEN 32U
+#if GS_USB_TX_DONE_LEN < (GS_USB_TX_ECHO_SLOTS * NUM_CAN_CHANNELS)
+#error "GS_USB_TX_DONE_LEN must cover every echo slot"
+#endif
+
+#define GS_USB_TX_EVT_ITS (FDCAN_IT_TX_EVT_FIFO_NEW_DATA | FDCAN_IT_TX_EVT_FIFO_FULL | FDCAN_IT_TX_EVT_FIFO_ELT_LOST)
+
+/* Software TX queue in front of the 3-deep hardware FIFO. Filled from EP1 OUT and emptied by
+ * gs_usb_tx_refill(); EP1 OUT is NAKed while any channel's queue is full. Frames stay in
+ * their slot and only the one-byte order entries move, so priority mode can insert by CAN ID
+ * with a short critical section. */
+#ifndef GS_USB_TX_QUEUE_LEN
+#define GS_USB_TX_QUEUE_LEN 32
+#endif
+#if (GS_USB_TX_QUEUE_LEN & (GS_USB_TX_QUEUE_LEN - 1)) != 0 || GS_USB_TX_QUEUE_LEN > 32
+#error "GS_USB_TX_QUEUE_LEN must be a power of two, at most 32"
+#endif
+
+struct gs_tx_queue {
+    struct gs_host_frame frm[GS_USB_TX_QUEUE_LEN];
+    uint8_t order[GS_USB_TX_QUEUE_LEN]; /* frm slots in send order, tail..head */
+    uint32_t deadline_us[GS_USB_TX_QUEUE_LEN];
+    volatile uint32_t used;             /* frm slots holding a frame */
+    volatile uint32_t timed;            /* frm slots with a deadline */
+    volatile uint16_t head;
+    volatile uint16_t tail;
+    uint16_t urgent;                    /* urgent frames first in line from tail, FIFO mode */
+};
+
+static uint8_t gs_tx_mode[NUM_CAN_CHANNELS] = {0};
+
+static struct gs_tx_queue gs_txq[NUM_CAN_CHANNELS] __attribute__((aligned(4)));
+
+static struct gs_host_frame gs_tx_echo[NUM_CAN_CHANNELS][GS_USB_TX_ECHO_SLOTS];
+static volatile uint32_t gs_tx_echo_used[NUM_CAN_CHANNELS] = {0};
+
+/* Deadline tracking per echo slot: which TX buffer holds it, and whether an abort was asked */
+struct gs_tx_slot_info {
+    uint32_t deadline_us;
+    uint8_t buf;
+};
+static struct gs_tx_slot_info gs_tx_info[NUM_CAN_CHANNELS][GS_USB_TX_ECHO_SLOTS];
+static volatile uint32_t gs_tx_inhw[NUM_CAN_CHANNELS] = {0};     /* in a TX buffer, no event yet */
+static volatile uint32_t gs_tx_timed[NUM_CAN_CHANNELS] = {0};    /* deadline_us is valid */
+static volatile uint32_t gs_tx_aborting[NUM_CAN_CHANNELS] = {0}; /* TXBCR written */
+static volatile uint32_t gs_tx_evt_lost[NUM_CAN_CHANNELS] = {0};
+static volatile uint32_t gs_tx_rejected = 0;
+
+/* Completed slots in transmit order, FDCAN interrupts to main loop. Pushes are masked
+ * like the RX queues. */
+static struct {
+    uint8_t channel;
+    uint8_t slot;
+    uint8_t cancelled;
+} gs_tx_done[GS_USB_TX_DONE_LEN];
+static volatile uint16_t gs_tx_done_head = 0;
+static volatile uint16_t gs_tx_done_tail = 0;
+
+/* Channel reset: its pending entries name slots that are about to be reused. Called from
+ * thread context, the only consumer, with interrupts masked. */
+static void gs_usb_tx_done_drop(uint8_t channel) {
+    uint16_t keep = gs_tx_done_tail;
+    for (uint16_t i = gs_tx_done_tail; i != gs_tx_done_head; i++) {
+        if (gs_tx_done[i & (GS_USB_TX_DONE_LEN - 1U)].channel != channel) {
+            gs_tx_done[keep & (GS_USB_TX_DONE_LEN - 1U)] = gs_tx_done[i & (GS_USB_TX_DONE_LEN - 1U)];
+            keep++;
+        }
+    }
+    gs_tx_done_head = keep;
+}
+
+#define FDCAN_STD_FILTERS_MAX 28U
+#define FDCAN_EXT_FILTERS_MAX 8U
+
 /* EP0 temp buffer for vendor IN responses */
 static uint8_t gs_ep0_buf[128];
-static uint8_t gs_can_started[NUM_CAN_CHANNELS] = {0};
+static volatile uint8_t gs_can_started[NUM_CAN_CHANNELS] = {0};
 static uint8_t gs_fd_enabled[NUM_CAN_CHANNELS] = {0};
+static uint8_t gs_hw_timestamp[NUM_CAN_CHANNELS] = {0};
+static uint8_t gs_data_bt_set[NUM_CAN_CHANNELS] = {0};
+
+/* Bit timing register values per channel, rebuilt only when the host sends a bittiming */
+struct gs_can_timing {
+    uint32_t nbtp;
+    uint32_t dbtp;
+    uint8_t valid;
+};
+static struct gs_can_timing gs_timing[NUM_CAN_CHANNELS];
 
 static FDCAN_HandleTypeDef *gs_usb_get_can(uint8_t channel) {
     if (channel == 0) {
@@ -84,19 +274,118 @@ static FDCAN_HandleTypeDef *gs_usb_get_can(uint8_t channel) {
     return NULL;
 }
 
+static uint8_t gs_usb_get_channel(const FDCAN_HandleTypeDef *hcan) {
+#if NUM_CAN_CHANNELS > 1
+    if (hcan == &hfdcan2) {
+        return 1;
+    }
+#endif
+#if NUM_CAN_CHANNELS > 2
+    if (hcan == &hfdcan3) {
+        return 2;
+    }
+#endif
+    return 0;
+}
+
+/* Transmitter delay compensation: above ~1 Mbit/s the transceiver loop delay exceeds the data
+ * bit sample point, so the secondary sample point is placed at the measured delay plus the
+ * data-phase sample point (data prescaler * (sync + data tseg1), in mtq). The controller only
+ * supports TDC for data prescalers 1 and 2; TDCO is a 7-bit field. */
+static void gs_usb_config_tdc(FDCAN_HandleTypeDef *hcan) {
+    if (hcan->Init.FrameFormat != FDCAN_FRAME_FD_BRS || hcan->Init.DataPrescaler > 2U) {
+        (void)HAL_FDCAN_DisableTxDelayCompensation(hcan);
+        return;
+    }
+
+    uint32_t offset = hcan->Init.DataPrescaler * (1U + hcan->Init.DataTimeSeg1);
+    if (offset > 127U) {
+        offset = 127U;
+    }
+    (void)HAL_FDCAN_ConfigTxDelayCompensation(hcan, offset, 0U);
+    (void)HAL_FDCAN_EnableTxDelayCompensation(hcan);
+}
+
+static void gs_usb_update_timing(uint8_t channel, const FDCAN_HandleTypeDef *hcan) {
+    const FDCAN_InitTypeDef *init = &hcan->Init;
+    gs_timing[channel].nbtp = ((init->NominalSyncJumpWidth - 1U) << FDCAN_NBTP_NSJW_Pos) |
+                              ((init->NominalTimeSeg1 - 1U) << FDCAN_NBTP_NTSEG1_Pos) |
+                              ((init->NominalTimeSeg2 - 1U) << FDCAN_NBTP_NTSEG2_Pos) |
+                              ((init->NominalPrescaler - 1U) << FDCAN_NBTP_NBRP_Pos);
+    gs_timing[channel].dbtp = ((init->DataSyncJumpWidth - 1U) << FDCAN_DBTP_DSJW_Pos) |
+                              ((init->DataTimeSeg1 - 1U) << FDCAN_DBTP_DTSEG1_Pos) |
+                              ((init->DataTimeSeg2 - 1U) << FDCAN_DBTP_DTSEG2_Pos) |
+                              ((init->DataPrescaler - 1U) << FDCAN_DBTP_DBRP_Pos);
+    gs_timing[channel].valid = 1;
+}
+
+static int gs_usb_fdcan_enter_config(FDCAN_GlobalTypeDef *inst) {
+    uint32_t spin = 100000U;
+    SET_BIT(inst->CCCR, FDCAN_CCCR_INIT);
+    while ((inst->CCCR & FDCAN_CCCR_INIT) == 0U) {
+        if (--spin == 0U) {
+            return -1;
+        }
+    }
+    SET_BIT(inst->CCCR, FDCAN_CCCR_CCE);
+    return 0;
+}
+
+/* Bring a stopped channel to the requested configuration without HAL_FDCAN_Init(): the G0
+ * message RAM layout is fixed, so only NBTP/DBTP, the frame format, operating mode and
+ * retransmission in CCCR/TEST, the TX FIFO/queue mode and the filter list sizes change.
+ * Elements left over from the previous session are dropped. */
+static int gs_usb_fdcan_reconfig(uint8_t channel, FDCAN_HandleTypeDef *hcan) {
+    if (hcan->State == HAL_FDCAN_STATE_RESET) {
+        return (HAL_FDCAN_Init(hcan) == HAL_OK) ? 0 : -1;
+    }
+
+    FDCAN_GlobalTypeDef *inst = hcan->Instance;
+    if (gs_usb_fdcan_enter_config(inst) != 0) {
+        return -1;
+    }
+    if (!gs_timing[channel].valid) {
+        gs_usb_update_timing(channel, hcan);
+    }
+
+    inst->NBTP = gs_timing[channel].nbtp;
+    inst->DBTP = gs_timing[channel].dbtp;
+    MODIFY_REG(inst->CCCR, FDCAN_CCCR_FDOE | FDCAN_CCCR_BRSE, hcan->Init.FrameFormat);
+    MODIFY_REG(inst->CCCR, FDCAN_CCCR_DAR, (hcan->Init.AutoRetransmission == ENABLE) ? 0U : FDCAN_CCCR_DAR);
+    MODIFY_REG(inst->TXBC, FDCAN_TXBC_TFQM, hcan->Init.TxFifoQueueMode);
+
+    /* Same table as HAL_FDCAN_Init(): MON for bus monitoring, TEST+LBCK for loopback */
+    CLEAR_BIT(inst->CCCR, FDCAN_CCCR_TEST | FDCAN_CCCR_MON | FDCAN_CCCR_ASM);
+    if (hcan->Init.Mode == FDCAN_MODE_BUS_MONITORING || hcan->Init.Mode == FDCAN_MODE_INTERNAL_LOOPBACK) {
+        SET_BIT(inst->CCCR, FDCAN_CCCR_MON);
+    }
+    if (hcan->Init.Mode == FDCAN_MODE_INTERNAL_LOOPBACK || hcan->Init.Mode == FDCAN_MODE_EXTERNAL_LOOPBACK) {
+        SET_BIT(inst->CCCR, FDCAN_CCCR_TEST);
+        SET_BIT(inst->TEST, FDCAN_TEST_LBCK);
+    }
+    MODIFY_REG(inst->RXGFC, FDCAN_RXGFC_LSS | FDCAN_RXGFC_LSE,
+               (hcan->Init.StdFiltersNbr << FDCAN_RXGFC_LSS_Pos) | (hcan->Init.ExtFiltersNbr << FDCAN_RXGFC_LSE_Pos));
+
+    while ((inst->RXF0S & FDCAN_RXF0S_F0FL) != 0U) {
+        inst->RXF0A = (inst->RXF0S & FDCAN_RXF0S_F0GI) >> FDCAN_RXF0S_F0GI_Pos;
+    }
+    while ((inst->RXF1S & FDCAN_RXF1S_F1FL) != 0U) {
+        inst->RXF1A = (inst->RXF1S & FDCAN_RXF1S_F1GI) >> FDCAN_RXF1S_F1GI_Pos;
+    }
+    while ((inst->TXEFS & FDCAN_TXEFS_EFFL) != 0U) {
+        inst->TXEFA = (inst->TXEFS & FDCAN_TXEFS_EFGI) >> FDCAN_TXEFS_EFGI_Pos;
+    }
+    return 0;
+}
+
 static int gs_usb_apply_bittiming(uint8_t channel,
                                   FDCAN_HandleTypeDef *hcan,
                                   const struct gs_device_bittiming *bt,
                                   uint8_t is_data) {
-    if (hcan == NULL || bt == NULL) {
+    if (hcan == NULL || bt == NULL || channel >= NUM_CAN_CHANNELS) {
         return -1;
     }
 
-
-    if (channel < NUM_CAN_CHANNELS && gs_can_started[channel]) {
-        (void)HAL_FDCAN_Stop(hcan);
-    }
-
     if (is_data) {
         hcan->Init.DataPrescaler = (uint32_t) bt->brp;
         hcan->Init.DataSyncJumpWidth = (uint32_t) bt->sjw;
@@ -108,56 +397,216 @@ static int gs_usb_apply_bittiming(uint8_t channel,
         hcan->Init.NominalTimeSeg1 = (uint32_t) (bt->prop_seg + bt->phase_seg1);
         hcan->Init.NominalTimeSeg2 = (uint32_t) bt->phase_seg2;
     }
+    gs_usb_update_timing(channel, hcan);
+
+    /* A stopped channel picks the new values up on the next start */
+    if (gs_can_started[channel]) {
+        gs_can_started[channel] = 0;
+        (void)HAL_FDCAN_Stop(hcan);
+        if (gs_usb_fdcan_reconfig(channel, hcan) != 0) {
+            return -1;
+        }
+        gs_usb_config_tdc(hcan);
+        (void)HAL_FDCAN_Start(hcan);
+        gs_can_started[channel] = 1;
+    }
+
+    return 0;
+}
+
+static uint32_t gs_usb_filter_id(uint32_t can_id) {
+    return (can_id & CAN_EFF_FLAG) ? (can_id & 0x1FFFFFFFU) : (can_id & 0x7FFU);
+}
+
+/* Filter elements needed for the given lists: priority entries, host filters,
+ * and one accept-all element per ID type while no host filter is set. */
+static uint8_t gs_usb_count_filters(const struct gs_prio_filter *prio,
+                                    uint8_t prio_cnt,
+                                    const struct gs_device_filter *flt,
+                                    uint8_t flt_cnt,
+                                    uint32_t *std_nbr,
+                                    uint32_t *ext_nbr) {
+    uint32_t std = (flt_cnt == 0U) ? 1U : 0U;
+    uint32_t ext = (flt_cnt == 0U) ? 1U : 0U;
+    for (uint8_t i = 0; i < prio_cnt; i++) {
+        if (prio[i].can_id & CAN_EFF_FLAG) {
+            ext++;
+        } else {
+            std++;
+        }
+    }
+    for (uint8_t i = 0; i < flt_cnt; i++) {
+        if (flt[i].id1 & CAN_EFF_FLAG) {
+            ext++;
+        } else {
+            std++;
+        }
+    }
+    *std_nbr = std;
+    *ext_nbr = ext;
+    return (std <= FDCAN_STD_FILTERS_MAX && ext <= FDCAN_EXT_FILTERS_MAX) ? 1U : 0U;
+}
+
+static void gs_usb_write_filter(FDCAN_HandleTypeDef *hcan,
+                                uint32_t *std_idx,
+                                uint32_t *ext_idx,
+                                uint32_t type,
+                                uint32_t config,
+                                uint32_t id1,
+                                uint32_t id2) {
+    FDCAN_FilterTypeDef filter = {0};
+    if (id1 & CAN_EFF_FLAG) {
+        filter.IdType = FDCAN_EXTENDED_ID;
+        filter.FilterIndex = (*ext_idx)++;
+    } else {
+        filter.IdType = FDCAN_STANDARD_ID;
+        filter.FilterIndex = (*std_idx)++;
+    }
+    filter.FilterType = type;
+    filter.FilterConfig = config;
+    filter.FilterID1 = gs_usb_filter_id(id1);
+    filter.FilterID2 = gs_usb_filter_id(id2);
+    (void)HAL_FDCAN_ConfigFilter(hcan, &filter);
+}
+
+/* Priority IDs go to RX FIFO1 at the lowest indices so they match first, then the
+ * host filters. Without host filters, accept-all elements route the rest to RX FIFO0. */
+static void gs_usb_config_filters(uint8_t channel, FDCAN_HandleTypeDef *hcan) {
+    static const uint32_t type_map[] = {FDCAN_FILTER_MASK, FDCAN_FILTER_RANGE, FDCAN_FILTER_DUAL};
+    static const uint32_t action_map[] = {FDCAN_FILTER_TO_RXFIFO0, FDCAN_FILTER_TO_RXFIFO1, FDCAN_FILTER_REJECT};
+    uint32_t std_idx = 0;
+    uint32_t ext_idx = 0;
+
+    for (uint8_t i = 0; i < gs_prio_filter_cnt[channel]; i++) {
+        const struct gs_prio_filter *pf = &gs_prio_filters[channel][i];
+        gs_usb_write_filter(hcan, &std_idx, &ext_idx, FDCAN_FILTER_MASK, FDCAN_FILTER_TO_RXFIFO1, pf->can_id,
+                            pf->can_mask | (pf->can_id & CAN_EFF_FLAG));
+    }
+
+    for (uint8_t i = 0; i < gs_filter_cnt[channel]; i++) {
+        const struct gs_device_filter *f = &gs_filters[channel][i];
+        gs_usb_write_filter(hcan, &std_idx, &ext_idx, type_map[f->type], action_map[f->action], f->id1, f->id2);
+    }
+
+    if (gs_filter_cnt[channel] == 0U) {
+        gs_usb_write_filter(hcan, &std_idx, &ext_idx, FDCAN_FILTER_MASK, FDCAN_FILTER_TO_RXFIFO0, 0, 0);
+        gs_usb_write_filter(hcan, &std_idx, &ext_idx, FDCAN_FILTER_MASK, FDCAN_FILTER_TO_RXFIFO0, CAN_EFF_FLAG, 0);
+        (void)HAL_FDCAN_ConfigGlobalFilter(hcan, FDCAN_ACCEPT_IN_RX_FIFO0, FDCAN_ACCEPT_IN_RX_FIFO0,
+                                           FDCAN_FILTER_REMOTE, FDCAN_FILTER_REMOTE);
+    } else {
+        (void)HAL_FDCAN_ConfigGlobalFilter(hcan, FDCAN_REJECT, FDCAN_REJECT, FDCAN_FILTER_REMOTE,
+                                           FDCAN_FILTER_REMOTE);
+    }
+}
 
-    if (HAL_FDCAN_Init(hcan) != HAL_OK) {
+/* Store priority entries starting at index first; first == 0 replaces the whole set, otherwise
+ * the entries past the new ones are kept */
+static int gs_usb_set_prio_filters(uint8_t channel, uint16_t first, const uint8_t *data, uint16_t len) {
+    uint16_t n = len / sizeof(struct gs_prio_filter);
+    uint16_t cnt = gs_prio_filter_cnt[channel];
+    if (first > cnt || first + n > GS_USB_MAX_PRIO_FILTERS) {
         return -1;
     }
+    if (first == 0U || first + n > cnt) {
+        cnt = (uint16_t) (first + n);
+    }
 
+    struct gs_prio_filter tmp[GS_USB_MAX_PRIO_FILTERS];
+    uint32_t std;
+    uint32_t ext;
+    memcpy(tmp, gs_prio_filters[channel], cnt * sizeof(tmp[0]));
+    if (n > 0U) {
+        memcpy(&tmp[first], data, n * sizeof(tmp[0]));
+    }
+    if (!gs_usb_count_filters(tmp, (uint8_t) cnt, gs_filters[channel], gs_filter_cnt[channel], &std, &ext)) {
+        return -1;
+    }
+
+    memcpy(gs_prio_filters[channel], tmp, cnt * sizeof(tmp[0]));
+    gs_prio_filter_cnt[channel] = (uint8_t) cnt;
     return 0;
 }
 
-static uint8_t gs_usb_dlc_to_len(uint32_t dlc) {
-    switch (dlc) {
-        case FDCAN_DLC_BYTES_0: return 0;
-        case FDCAN_DLC_BYTES_1: return 1;
-        case FDCAN_DLC_BYTES_2: return 2;
-        case FDCAN_DLC_BYTES_3: return 3;
-        case FDCAN_DLC_BYTES_4: return 4;
-        case FDCAN_DLC_BYTES_5: return 5;
-        case FDCAN_DLC_BYTES_6: return 6;
-        case FDCAN_DLC_BYTES_7: return 7;
-        case FDCAN_DLC_BYTES_8: return 8;
-        case FDCAN_DLC_BYTES_12: return 12;
-        case FDCAN_DLC_BYTES_16: return 16;
-        case FDCAN_DLC_BYTES_20: return 20;
-        case FDCAN_DLC_BYTES_24: return 24;
-        case FDCAN_DLC_BYTES_32: return 32;
-        case FDCAN_DLC_BYTES_48: return 48;
-        case FDCAN_DLC_BYTES_64: return 64;
-        default: return 8;
-    }
-}
-
-static uint32_t gs_usb_len_to_dlc(uint8_t len) {
-    switch (len) {
-        case 0: return FDCAN_DLC_BYTES_0;
-        case 1: return FDCAN_DLC_BYTES_1;
-        case 2: return FDCAN_DLC_BYTES_2;
-        case 3: return FDCAN_DLC_BYTES_3;
-        case 4: return FDCAN_DLC_BYTES_4;
-        case 5: return FDCAN_DLC_BYTES_5;
-        case 6: return FDCAN_DLC_BYTES_6;
-        case 7: return FDCAN_DLC_BYTES_7;
-        case 8: return FDCAN_DLC_BYTES_8;
-        case 12: return FDCAN_DLC_BYTES_12;
-        case 16: return FDCAN_DLC_BYTES_16;
-        case 20: return FDCAN_DLC_BYTES_20;
-        case 24: return FDCAN_DLC_BYTES_24;
-        case 32: return FDCAN_DLC_BYTES_32;
-        case 48: return FDCAN_DLC_BYTES_48;
-        case 64: return FDCAN_DLC_BYTES_64;
-        default: return FDCAN_DLC_BYTES_8;
+/* Store host filters starting at index first; first == 0 replaces the whole list, otherwise
+ * the filters past the new ones are kept */
+static int gs_usb_set_filters(uint8_t channel, uint16_t first, const uint8_t *data, uint16_t len) {
+    uint16_t n = len / sizeof(struct gs_device_filter);
+    uint16_t cnt = gs_filter_cnt[channel];
+    if (first > cnt || first + n > GS_USB_MAX_FILTERS) {
+        return -1;
+    }
+    if (first == 0U || first + n > cnt) {
+        cnt = (uint16_t) (first + n);
+    }
+
+    struct gs_device_filter tmp[GS_USB_MAX_FILTERS];
+    uint32_t std;
+    uint32_t ext;
+    memcpy(tmp, gs_filters[channel], cnt * sizeof(tmp[0]));
+    if (n > 0U) {
+        memcpy(&tmp[first], data, n * sizeof(tmp[0]));
+    }
+    for (uint16_t i = first; i < first + n; i++) {
+        if (tmp[i].type > GS_FILTER_TYPE_DUAL || tmp[i].action > GS_FILTER_REJECT) {
+            return -1;
+        }
+        /* Both IDs of an element share its type */
+        tmp[i].id2 = (tmp[i].id2 & ~CAN_EFF_FLAG) | (tmp[i].id1 & CAN_EFF_FLAG);
     }
+    if (!gs_usb_count_filters(gs_prio_filters[channel], gs_prio_filter_cnt[channel], tmp, (uint8_t) cnt, &std, &ext)) {
+        return -1;
+    }
+
+    memcpy(gs_filters[channel], tmp, cnt * sizeof(tmp[0]));
+    gs_filter_cnt[channel] = (uint8_t) cnt;
+    return 0;
+}
+
+/* Bytes of a host frame on the wire: header, the classic or FD data area and the optional
+ * timestamp. Fixed per frame type so batched transfers can be split by the host. */
+static uint16_t gs_usb_frame_size(const struct gs_host_frame *frm) {
+    uint16_t size = (uint16_t) (offsetof(struct gs_host_frame, data) + ((frm->flags & GS_CAN_FLAG_FD) ? 64U : 8U));
+    if (frm->channel < NUM_CAN_CHANNELS && gs_hw_timestamp[frm->channel]) {
+        size += sizeof(uint32_t);
+    }
+    return size;
+}
+
+/* The timestamp sits right after the data area, which is shorter for classic frames */
+static void gs_usb_put_timestamp(struct gs_host_frame *frm, uint32_t ts) {
+    uint8_t *dst = (frm->flags & GS_CAN_FLAG_FD) ? (uint8_t *) &frm->timestamp_us : &frm->data[8];
+    memcpy(dst, &ts, sizeof(ts));
+}
+
+static uint32_t gs_usb_get_timestamp(const struct gs_host_frame *frm) {
+    const uint8_t *src = (frm->flags & GS_CAN_FLAG_FD) ? (const uint8_t *) &frm->timestamp_us : &frm->data[8];
+    uint32_t ts;
+    memcpy(&ts, src, sizeof(ts));
+    return ts;
+}
+
+/* Echo slots are claimed from the USB interrupt and released from the main loop */
+static int gs_usb_echo_alloc(uint8_t channel) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t used = gs_tx_echo_used[channel];
+    int slot = -1;
+    for (int i = 0; i < GS_USB_TX_ECHO_SLOTS; i++) {
+        if ((used & (1UL << i)) == 0U) {
+            gs_tx_echo_used[channel] = used | (1UL << i);
+            slot = i;
+            break;
+        }
+    }
+    __set_PRIMASK(primask);
+    return slot;
+}
+
+static void gs_usb_echo_free(uint8_t channel, uint8_t slot) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    gs_tx_echo_used[channel] &= ~(1UL << slot);
+    __set_PRIMASK(primask);
 }
 
 static void gs_usb_ep0_send_padded(const usb_setup_pkt_t *req, const void *data, uint16_t data_len) {
@@ -173,6 +622,40 @@ static void gs_usb_ep0_send_padded(const usb_setup_pkt_t *req, const void *data,
     usb_ep0_send(gs_ep0_buf, len);
 }
 
+static void gs_usb_err_reset(uint8_t channel) {
+    struct gs_can_err *e = &gs_err[channel];
+    e->state = GS_CAN_STATE_ERROR_ACTIVE;
+    e->reported = GS_CAN_STATE_ERROR_ACTIVE;
+    e->prot = 0;
+    e->loc = 0;
+    e->ack = 0;
+    e->pending = 0;
+    e->restarted = 0;
+    e->tx_timeout = 0;
+    e->last_us = gs_timer_now() - GS_USB_ERR_INTERVAL_US;
+
+    gs_busoff[channel].waiting = 0;
+    gs_busoff[channel].restarting = 0;
+    gs_busoff[channel].delay_us = gs_busoff[channel].policy.delay_us;
+}
+
+static int gs_usb_set_busoff(uint8_t channel, const uint8_t *data, uint16_t len) {
+    struct gs_busoff_policy policy;
+    if (len < sizeof(policy)) {
+        return -1;
+    }
+    memcpy(&policy, data, sizeof(policy));
+    if (policy.mode > GS_BUSOFF_AUTO) {
+        return -1;
+    }
+    if (policy.max_delay_us < policy.delay_us) {
+        policy.max_delay_us = policy.delay_us;
+    }
+    gs_busoff[channel].policy = policy;
+    gs_busoff[channel].delay_us = policy.delay_us;
+    return 0;
+}
+
 /* ================= Vendor request handler ================= */
 
 int usb_handle_gs_usb_request(const usb_setup_pkt_t *req, const uint8_t *data, uint16_t len) {
@@ -185,13 +668,19 @@ int usb_handle_gs_usb_request(const usb_setup_pkt_t *req, const uint8_t *data, u
             gs_usb_ep0_send_padded(req, &gs_dev_cfg, sizeof(gs_dev_cfg));
             return 0;
 
-        case GS_USB_BREQ_BT_CONST:
-            gs_usb_ep0_send_padded(req, &gs_bt_const, sizeof(gs_bt_const));
+        case GS_USB_BREQ_BT_CONST: {
+            struct gs_usb_bittiming_const btc = gs_bt_const;
+            btc.fclk_can = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_FDCAN);
+            gs_usb_ep0_send_padded(req, &btc, sizeof(btc));
             return 0;
+        }
 
-        case GS_USB_BREQ_BT_CONST_EXT:
-            gs_usb_ep0_send_padded(req, &gs_bt_const_ext, sizeof(gs_bt_const_ext));
+        case GS_USB_BREQ_BT_CONST_EXT: {
+            struct gs_device_bt_const_extended btc = gs_bt_const_ext;
+            btc.fclk_can = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_FDCAN);
+            gs_usb_ep0_send_padded(req, &btc, sizeof(btc));
             return 0;
+        }
 
         case GS_USB_BREQ_GET_STATE: {
             struct gs_device_state st = {0};
@@ -199,13 +688,38 @@ int usb_handle_gs_usb_request(const usb_setup_pkt_t *req, const uint8_t *data, u
             if (channel >= NUM_CAN_CHANNELS) {
                 return -1;
             }
-            st.state = gs_can_started[channel] ? GS_CAN_STATE_ERROR_ACTIVE : GS_CAN_STATE_STOPPED;
-            st.rxerr = 0;
-            st.txerr = 0;
+            st.state = GS_CAN_STATE_STOPPED;
+            if (gs_can_started[channel]) {
+                FDCAN_ErrorCountersTypeDef ec;
+                (void)HAL_FDCAN_GetErrorCounters(gs_usb_get_can(channel), &ec);
+                st.state = gs_err[channel].state;
+                st.rxerr = ec.RxErrorCnt;
+                st.txerr = ec.TxErrorCnt;
+            }
             gs_usb_ep0_send_padded(req, &st, sizeof(st));
             return 0;
         }
 
+        case GS_USB_BREQ_EXT_STATS: {
+            struct gs_device_stats stats = {0};
+            usb_ep1_stats_t ep1;
+            uint8_t channel = (uint8_t) (req->wIndex & 0xFF);
+            if (channel >= NUM_CAN_CHANNELS) {
+                return -1;
+            }
+            usb_ep1_get_stats(&ep1);
+            stats.in_queued = ep1.queued;
+            stats.in_overflow = ep1.overflow;
+            stats.in_transfers = ep1.transfers;
+            stats.in_high_water = ep1.high_water;
+            stats.rx_overflow = gs_rx_lo.overflow + gs_rx_hi.overflow;
+            stats.rx_fifo_lost = gs_rx_fifo_lost[channel];
+            stats.tx_evt_lost = gs_tx_evt_lost[channel];
+            stats.tx_rejected = gs_tx_rejected;
+            gs_usb_ep0_send_padded(req, &stats, sizeof(stats));
+            return 0;
+        }
+
         case GS_USB_BREQ_GET_TERMINATION: {
             uint32_t term = GS_CAN_TERMINATION_STATE_OFF;
             gs_usb_ep0_send_padded(req, &term, sizeof(term));
@@ -219,16 +733,35 @@ int usb_handle_gs_usb_request(const usb_setup_pkt_t *req, const uint8_t *data, u
         }
 
         case GS_USB_BREQ_TIMESTAMP: {
-            static uint32_t ts = 0;
+            uint32_t ts = gs_timer_now();
             gs_usb_ep0_send_padded(req, &ts, sizeof(ts));
             return 0;
         }
 
+        case GS_USB_BREQ_BERR: {
+            uint8_t channel = (uint8_t) (req->wIndex & 0xFF);
+            if (channel >= NUM_CAN_CHANNELS) {
+                return -1;
+            }
+            if (len >= 4 && data != NULL) {
+                uint32_t enable = 0;
+                memcpy(&enable, data, sizeof(enable));
+                /* Picked up on the next start */
+                gs_err[channel].berr_req = enable ? 1U : 0U;
+            }
+            if (data == NULL) {
+                usb_ep0_ack();
+            }
+            return 0;
+        }
+
         case GS_USB_BREQ_IDENTIFY:
-        case GS_USB_BREQ_BERR:
         case GS_USB_BREQ_SET_USER_ID:
         case GS_USB_BREQ_SET_TERMINATION:
-            usb_ep0_ack();
+            /* With a data stage the status stage is sent by usb_ep0_poll() */
+            if (data == NULL) {
+                usb_ep0_ack();
+            }
             return 0;
 
         case GS_USB_BREQ_MODE:
@@ -246,34 +779,70 @@ int usb_handle_gs_usb_request(const usb_setup_pkt_t *req, const uint8_t *data, u
                 }
 
                 gs_fd_enabled[channel] = (flags & GS_CAN_MODE_FD) ? 1 : 0;
+                gs_hw_timestamp[channel] = (flags & GS_CAN_MODE_HW_TIMESTAMP) ? 1 : 0;
                 
                 if (mode == GS_CAN_MODE_START && !gs_can_started[channel]) {
-                    FDCAN_FilterTypeDef filter = {0};
-                    filter.FilterIndex = 0;
-                    filter.FilterType = FDCAN_FILTER_MASK;
-                    filter.FilterConfig = FDCAN_FILTER_TO_RXFIFO0;
-                    filter.FilterID1 = 0;
-                    filter.FilterID2 = 0;
-                    filter.IdType = FDCAN_STANDARD_ID;
-                    (void)HAL_FDCAN_ConfigFilter(hcan, &filter);
-
-                    filter.FilterIndex = 1;
-                    filter.IdType = FDCAN_EXTENDED_ID;
-                    (void)HAL_FDCAN_ConfigFilter(hcan, &filter);
-
+                    gs_err[channel].berr =
+                        ((flags & GS_CAN_MODE_BERR_REPORTING) || gs_err[channel].berr_req) ? 1U : 0U;
                     if (gs_fd_enabled[channel]) {
-                        hcan->Init.FrameFormat = FDCAN_FRAME_FD_NO_BRS;
+                        /* Frames flagged BRS switch to the data bittiming once the host has set one */
+                        hcan->Init.FrameFormat = gs_data_bt_set[channel] ? FDCAN_FRAME_FD_BRS : FDCAN_FRAME_FD_NO_BRS;
                     } else {
                         hcan->Init.FrameFormat = FDCAN_FRAME_CLASSIC;
                     }
+                    /* Loopback with listen-only stays off the bus entirely; plain loopback still drives it */
+                    if (flags & GS_CAN_MODE_LOOP_BACK) {
+                        hcan->Init.Mode = (flags & GS_CAN_MODE_LISTEN_ONLY) ? FDCAN_MODE_INTERNAL_LOOPBACK
+                                                                            : FDCAN_MODE_EXTERNAL_LOOPBACK;
+                    } else if (flags & GS_CAN_MODE_LISTEN_ONLY) {
+                        hcan->Init.Mode = FDCAN_MODE_BUS_MONITORING;
+                    } else {
+                        hcan->Init.Mode = FDCAN_MODE_NORMAL;
+                    }
+                    hcan->Init.AutoRetransmission = (flags & GS_CAN_MODE_ONE_SHOT) ? DISABLE : ENABLE;
+                    hcan->Init.TxFifoQueueMode = (gs_tx_mode[channel] == GS_TX_MODE_PRIORITY) ? FDCAN_TX_QUEUE_OPERATION
+                                                                                             : FDCAN_TX_FIFO_OPERATION;
+                    (void)gs_usb_count_filters(gs_prio_filters[channel], gs_prio_filter_cnt[channel], gs_filters[channel],
+                                               gs_filter_cnt[channel], &hcan->Init.StdFiltersNbr,
+                                               &hcan->Init.ExtFiltersNbr);
 
-                    (void)HAL_FDCAN_Init(hcan);
+                    if (gs_usb_fdcan_reconfig(channel, hcan) != 0) {
+                        return -1;
+                    }
+                    gs_usb_config_filters(channel, hcan);
+                    gs_usb_config_tdc(hcan);
+                    (void)HAL_FDCAN_ConfigInterruptLines(hcan, GS_USB_FDCAN_IT_GROUPS,
+                                                         (hcan->Instance == FDCAN1) ? FDCAN1_INTERRUPT_LINE
+                                                                                    : FDCAN2_INTERRUPT_LINE);
+                    gs_usb_err_reset(channel);
                     (void)HAL_FDCAN_Start(hcan);
-                    (void)HAL_FDCAN_ActivateNotification(hcan, FDCAN_IT_RX_FIFO0_NEW_MESSAGE, 0);
+                    (void)HAL_FDCAN_ActivateNotification(
+                        hcan, GS_USB_RX_FIFO0_ITS | GS_USB_RX_FIFO1_ITS | GS_USB_TX_EVT_ITS | GS_USB_ERR_ITS, 0);
+                    if (gs_err[channel].berr) {
+                        (void)HAL_FDCAN_ActivateNotification(hcan, GS_USB_BERR_ITS, 0);
+                    } else {
+                        (void)HAL_FDCAN_DeactivateNotification(hcan, GS_USB_BERR_ITS);
+                    }
                     gs_can_started[channel] = 1;
+                    gs_cyclic_restart(channel);
                 } else if (mode == GS_CAN_MODE_RESET && gs_can_started[channel]) {
-                    (void)HAL_FDCAN_Stop(hcan);
+                    /* Runs in thread context: stop bulk OUT feeding the channel before stopping it */
                     gs_can_started[channel] = 0;
+                    (void)HAL_FDCAN_Stop(hcan);
+                    /* Frames still pending in hardware will never produce an event */
+                    uint32_t primask = __get_PRIMASK();
+                    __disable_irq();
+                    gs_tx_echo_used[channel] = 0;
+                    gs_tx_inhw[channel] = 0;
+                    gs_tx_timed[channel] = 0;
+                    gs_tx_aborting[channel] = 0;
+                    gs_usb_tx_done_drop(channel);
+                    gs_txq[channel].tail = gs_txq[channel].head;
+                    gs_txq[channel].urgent = 0;
+                    gs_txq[channel].used = 0;
+                    gs_txq[channel].timed = 0;
+                    __set_PRIMASK(primask);
+                    gs_replay_flush(channel);
                 }
             }
 
@@ -299,11 +868,98 @@ int usb_handle_gs_usb_request(const usb_setup_pkt_t *req, const uint8_t *data, u
                 if (channel >= NUM_CAN_CHANNELS) {
                     return -1;
                 }
-                (void)gs_usb_apply_bittiming(channel, gs_usb_get_can(channel), &bt, 1);
+                if (gs_usb_apply_bittiming(channel, gs_usb_get_can(channel), &bt, 1) == 0) {
+                    gs_data_bt_set[channel] = 1;
+                }
             }
             return 0;
 
         case GS_USB_BREQ_HOST_FORMAT:
+            /* Sent by the kernel driver on probe: fall back to one frame per transfer */
+            usb_ep1_set_batching(0);
+            return 0;
+
+        case GS_USB_BREQ_EXT_PRIO_FILTER: {
+            uint8_t channel = (uint8_t) (req->wIndex & 0xFF);
+            if (channel >= NUM_CAN_CHANNELS) {
+                return -1;
+            }
+            if (data == NULL) {
+                /* No data stage: clear the set */
+                gs_prio_filter_cnt[channel] = 0;
+                usb_ep0_ack();
+                return 0;
+            }
+            return gs_usb_set_prio_filters(channel, req->wValue, data, len);
+        }
+
+        case GS_USB_BREQ_EXT_FILTER: {
+            uint8_t channel = (uint8_t) (req->wIndex & 0xFF);
+            if (channel >= NUM_CAN_CHANNELS) {
+                return -1;
+            }
+            if (data == NULL) {
+                /* No data stage: back to accept-all */
+                gs_filter_cnt[channel] = 0;
+                usb_ep0_ack();
+                return 0;
+            }
+            return gs_usb_set_filters(channel, req->wValue, data, len);
+        }
+
+        case GS_USB_BREQ_EXT_TX_MODE: {
+            uint8_t channel = (uint8_t) (req->wIndex & 0xFF);
+            if (channel >= NUM_CAN_CHANNELS || req->wValue > GS_TX_MODE_PRIORITY || gs_can_started[channel]) {
+                return -1;
+            }
+            gs_tx_mode[channel] = (uint8_t) req->wValue;
+            if (data == NULL) {
+                usb_ep0_ack();
+            }
+            return 0;
+        }
+
+        case GS_USB_BREQ_EXT_CYCLIC: {
+            uint8_t channel = (uint8_t) (req->wIndex & 0xFF);
+            if (channel >= NUM_CAN_CHANNELS) {
+                return -1;
+            }
+            if (data == NULL) {
+                /* No data stage: stop every periodic frame on the channel */
+                gs_cyclic_clear(channel);
+                usb_ep0_ack();
+                return 0;
+            }
+            return gs_cyclic_set(channel, req->wValue, data, len);
+        }
+
+        case GS_USB_BREQ_EXT_GATEWAY: {
+            uint8_t channel = (uint8_t) (req->wIndex & 0xFF);
+            if (channel >= NUM_CAN_CHANNELS) {
+                return -1;
+            }
+            if (data == NULL) {
+                /* No data stage: stop routing frames from this channel */
+                gs_gateway_clear(channel);
+                usb_ep0_ack();
+                return 0;
+            }
+            return gs_gateway_set(channel, req->wValue, data, len);
+        }
+
+        case GS_USB_BREQ_EXT_BUSOFF: {
+            uint8_t channel = (uint8_t) (req->wIndex & 0xFF);
+            if (channel >= NUM_CAN_CHANNELS || data == NULL) {
+                return -1;
+            }
+            return gs_usb_set_busoff(channel, data, len);
+        }
+
+        case GS_USB_BREQ_EXT_RX_BATCH:
+            usb_ep1_set_batching(req->wValue ? 1 : 0);
+            if (data == NULL) {
+                usb_ep0_ack();
+            }
             return 0;
 
         default:
@@ -311,83 +967,729 @@ int usb_handle_gs_usb_request(const usb_setup_pkt_t *req, const uint8_t *data, u
     }
 }
 
-void gs_usb_handle_bulk_out(uint16_t len) {
-    if (len < (sizeof(struct gs_host_frame) - 64 + 8)) {
+/* Called with interrupts masked. Every live slot fits the ring, so it can only be full if
+ * that invariant breaks; the slot is then left in flight until the channel is reset. */
+static void gs_usb_tx_done_push(uint8_t channel, uint8_t slot, uint8_t cancelled) {
+    uint16_t head = gs_tx_done_head;
+    if ((uint16_t) (head - gs_tx_done_tail) >= GS_USB_TX_DONE_LEN) {
         return;
     }
+    gs_tx_done[head & (GS_USB_TX_DONE_LEN - 1U)].channel = channel;
+    gs_tx_done[head & (GS_USB_TX_DONE_LEN - 1U)].slot = slot;
+    gs_tx_done[head & (GS_USB_TX_DONE_LEN - 1U)].cancelled = cancelled;
+    __DMB();
+    gs_tx_done_head = (uint16_t) (head + 1U);
+}
 
-    const struct gs_host_frame *frm = (const struct gs_host_frame *) ep1_rx_buf;
-    FDCAN_HandleTypeDef *hcan = gs_usb_get_can(frm->channel);
-    if (hcan == NULL) {
-        return;
+/* Hand one queued frame to the hardware TX FIFO. Returns -1 when it has to stay queued. */
+static int gs_usb_tx_submit(FDCAN_HandleTypeDef *hcan,
+                            uint8_t channel,
+                            const struct gs_host_frame *frm,
+                            uint8_t timed,
+                            uint32_t deadline_us) {
+    int slot = gs_usb_echo_alloc(channel);
+    if (slot < 0) {
+        return -1;
     }
+    memcpy(&gs_tx_echo[channel][slot], frm, sizeof(struct gs_host_frame));
+
+    int buf = gs_mram_tx_put(hcan, frm, (uint8_t) slot);
+    if (buf < 0) {
+        gs_usb_echo_free(channel, (uint8_t) slot);
+        return -1;
+    }
+    gs_tx_info[channel][slot].buf = (uint8_t) buf;
+    gs_tx_info[channel][slot].deadline_us = deadline_us;
+    gs_tx_inhw[channel] |= 1UL << slot;
+    if (timed) {
+        gs_tx_timed[channel] |= 1UL << slot;
+    } else {
+        gs_tx_timed[channel] &= ~(1UL << slot);
+    }
+    return 0;
+}
 
-    uint32_t can_id = frm->can_id;
-    if (can_id & CAN_ERR_FLAG) {
+/* Expired frame that never reached the controller: echo it as cancelled */
+static int gs_usb_tx_cancel(uint8_t channel, const struct gs_host_frame *frm) {
+    int slot = gs_usb_echo_alloc(channel);
+    if (slot < 0) {
+        return -1;
+    }
+    memcpy(&gs_tx_echo[channel][slot], frm, sizeof(struct gs_host_frame));
+    gs_tx_echo[channel][slot].timestamp_us = gs_timer_now();
+    gs_usb_tx_done_push(channel, (uint8_t) slot, 1);
+    return 0;
+}
+
+/* Settle aborts before a TX buffer can be reused: TXBTO means the frame went out anyway and
+ * its TX event will follow, TXBCF alone means it was cancelled. Interrupts masked. */
+static void gs_usb_tx_reap_aborts(uint8_t channel, FDCAN_HandleTypeDef *hcan) {
+    uint32_t aborting = gs_tx_aborting[channel];
+    if (aborting == 0U) {
         return;
     }
+    uint32_t sent = hcan->Instance->TXBTO;
+    uint32_t cancelled = hcan->Instance->TXBCF;
+    for (uint8_t slot = 0; slot < GS_USB_TX_ECHO_SLOTS; slot++) {
+        if ((aborting & (1UL << slot)) == 0U) {
+            continue;
+        }
+        uint32_t bit = 1UL << gs_tx_info[channel][slot].buf;
+        if (sent & bit) {
+            gs_tx_aborting[channel] &= ~(1UL << slot);
+        } else if (cancelled & bit) {
+            gs_tx_aborting[channel] &= ~(1UL << slot);
+            gs_tx_inhw[channel] &= ~(1UL << slot);
+            gs_tx_echo[channel][slot].timestamp_us = gs_timer_now();
+            gs_usb_tx_done_push(channel, slot, 1);
+        }
+    }
+}
 
-    FDCAN_TxHeaderTypeDef tx = {0};
-    uint8_t is_fd = (frm->flags & GS_CAN_FLAG_FD) ? 1 : 0;
-    uint8_t is_brs = (frm->flags & GS_CAN_FLAG_BRS) ? 1 : 0;
-    tx.IdType = (can_id & CAN_EFF_FLAG) ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
-    tx.Identifier = (can_id & CAN_EFF_FLAG) ? (can_id & 0x1FFFFFFFU) : (can_id & 0x7FFU);
-    tx.TxFrameType = (can_id & CAN_RTR_FLAG) ? FDCAN_REMOTE_FRAME : FDCAN_DATA_FRAME;
-    tx.DataLength = gs_usb_len_to_dlc(frm->can_dlc);
-    tx.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
-    tx.BitRateSwitch = is_brs ? FDCAN_BRS_ON : FDCAN_BRS_OFF;
-    tx.FDFormat = is_fd ? FDCAN_FD_CAN : FDCAN_CLASSIC_CAN;
-    tx.TxEventFifoControl = FDCAN_NO_TX_EVENTS;
-    tx.MessageMarker = 0;
+/* Move queued frames into the hardware FIFO while it has room. Runs from the USB interrupt,
+ * the FDCAN interrupt and the main loop, so the whole refill is one critical section. Room is
+ * taken from TFQF: the free level TFFL reads 0 in TX queue mode. */
+static void gs_usb_tx_refill(uint8_t channel) {
+    struct gs_tx_queue *q = &gs_txq[channel];
+    FDCAN_HandleTypeDef *hcan = gs_usb_get_can(channel);
 
-    uint8_t data_bytes[64] = {0};
-    uint8_t payload_len = gs_usb_dlc_to_len(tx.DataLength);
-    uint8_t copy_len = (payload_len > 64) ? 64 : payload_len;
-    memcpy(data_bytes, frm->data, copy_len);
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    gs_usb_tx_reap_aborts(channel, hcan);
+    while (q->tail != q->head) {
+        uint8_t slot = q->order[q->tail & (GS_USB_TX_QUEUE_LEN - 1U)];
+        uint8_t timed = (q->timed & (1UL << slot)) ? 1U : 0U;
+        if (timed && (int32_t) (gs_timer_now() - q->deadline_us[slot]) >= 0) {
+            if (gs_usb_tx_cancel(channel, &q->frm[slot]) != 0) {
+                break;
+            }
+        } else if ((hcan->Instance->TXFQS & FDCAN_TXFQS_TFQF) != 0U ||
+                   gs_usb_tx_submit(hcan, channel, &q->frm[slot], timed, q->deadline_us[slot]) != 0) {
+            break;
+        }
+        q->used &= ~(1UL << slot);
+        q->timed &= ~(1UL << slot);
+        q->tail = (uint16_t) (q->tail + 1U);
+        if (q->urgent > 0U) {
+            q->urgent--;
+        }
+    }
+    __set_PRIMASK(primask);
+}
 
-    if (HAL_FDCAN_AddMessageToTxFifoQ(hcan, &tx, data_bytes) == HAL_OK) {
-        /* Echo back as TX complete */
-        uint16_t out_len = 16U + payload_len;
-        usb_ep1_send((const uint8_t *) frm, out_len);
+/* Arbitration order: base ID first, then a standard frame before an extended one with the
+ * same base ID, then the extended ID bits */
+static uint32_t gs_usb_tx_prio_key(uint32_t can_id) {
+    if (can_id & CAN_EFF_FLAG) {
+        uint32_t id = can_id & 0x1FFFFFFFU;
+        return ((id >> 18) << 19) | (1UL << 18) | (id & 0x3FFFFU);
     }
+    return (can_id & 0x7FFU) << 19;
 }
 
-void HAL_FDCAN_RxFifo0Callback(FDCAN_HandleTypeDef *hfdcan, uint32_t RxFifo0ITs) {
-    if ((RxFifo0ITs & FDCAN_IT_RX_FIFO0_NEW_MESSAGE) == 0U) {
+/* Link a filled slot into the send order: appended in FIFO mode (or behind the urgent frames
+ * already ahead of host traffic when urgent), behind every frame with an equal or lower key
+ * in priority mode */
+static void gs_usb_tx_enqueue(uint8_t channel, uint8_t slot, uint32_t deadline_ms, uint8_t urgent) {
+    struct gs_tx_queue *q = &gs_txq[channel];
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (deadline_ms != 0U) {
+        q->deadline_us[slot] = gs_timer_now() + deadline_ms * 1000U;
+        q->timed |= 1UL << slot;
+    }
+    uint16_t pos = q->head;
+    if (urgent && gs_tx_mode[channel] != GS_TX_MODE_PRIORITY) {
+        uint16_t at = (uint16_t) (q->tail + q->urgent);
+        while (pos != at) {
+            q->order[pos & (GS_USB_TX_QUEUE_LEN - 1U)] = q->order[(uint16_t) (pos - 1U) & (GS_USB_TX_QUEUE_LEN - 1U)];
+            pos--;
+        }
+        q->urgent++;
+    } else if (gs_tx_mode[channel] == GS_TX_MODE_PRIORITY) {
+        uint32_t key = gs_usb_tx_prio_key(q->frm[slot].can_id);
+        while (pos != q->tail) {
+            uint8_t prev = q->order[(uint16_t) (pos - 1U) & (GS_USB_TX_QUEUE_LEN - 1U)];
+            if (gs_usb_tx_prio_key(q->frm[prev].can_id) <= key) {
+                break;
+            }
+            q->order[pos & (GS_USB_TX_QUEUE_LEN - 1U)] = prev;
+            pos--;
+        }
+    }
+    q->order[pos & (GS_USB_TX_QUEUE_LEN - 1U)] = slot;
+    q->head = (uint16_t) (q->head + 1U);
+    __set_PRIMASK(primask);
+}
+
+/* Claim a free frame slot, -1 when the queue is full */
+static int gs_usb_tx_slot_alloc(uint8_t channel) {
+    struct gs_tx_queue *q = &gs_txq[channel];
+    int slot = -1;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    for (int i = 0; i < GS_USB_TX_QUEUE_LEN; i++) {
+        if ((q->used & (1UL << i)) == 0U) {
+            q->used |= 1UL << i;
+            slot = i;
+            break;
+        }
+    }
+    __set_PRIMASK(primask);
+    return slot;
+}
+
+static uint16_t gs_usb_tx_queue_room(uint8_t channel) {
+    return (uint16_t) (GS_USB_TX_QUEUE_LEN - (uint16_t) (gs_txq[channel].head - gs_txq[channel].tail));
+}
+
+/* A host frame that cannot be queued is echoed straight back with GS_CAN_FLAG_OVERFLOW, so
+ * the host driver releases its TX context instead of waiting for an echo that never comes */
+static void gs_usb_tx_reject(const uint8_t *buf, uint16_t len) {
+    struct gs_host_frame echo;
+
+    gs_tx_rejected++;
+    if (len < sizeof(echo.echo_id)) {
+        return;
+    }
+    memset(&echo, 0, sizeof(echo));
+    memcpy(&echo, buf, (len > sizeof(echo)) ? sizeof(echo) : len);
+    if (echo.echo_id == 0xFFFFFFFFU) {
+        return;
+    }
+    echo.flags = (uint8_t) ((echo.flags & ~GS_CAN_FLAG_TX_AT) | GS_CAN_FLAG_OVERFLOW);
+    echo.reserved = GS_TX_ECHO_CANCELLED;
+    if (echo.channel < NUM_CAN_CHANNELS && gs_hw_timestamp[echo.channel]) {
+        gs_usb_put_timestamp(&echo, gs_timer_now());
+    }
+    (void)usb_ep1_send((const uint8_t *) &echo, gs_usb_frame_size(&echo));
+}
+
+void gs_usb_handle_bulk_out(const uint8_t *buf, uint16_t len) {
+    if (len < offsetof(struct gs_host_frame, data) + 8U) {
+        gs_usb_tx_reject(buf, len);
+        return;
+    }
+
+    const struct gs_host_frame *frm = (const struct gs_host_frame *) buf;
+    uint8_t channel = frm->channel;
+    if (gs_usb_get_can(channel) == NULL || channel >= NUM_CAN_CHANNELS || !gs_can_started[channel] ||
+        (frm->can_id & CAN_ERR_FLAG)) {
+        gs_usb_tx_reject(buf, len);
         return;
     }
 
-    FDCAN_RxHeaderTypeDef rx = {0};
-    uint8_t data[64] = {0};
-    if (HAL_FDCAN_GetRxMessage(hfdcan, FDCAN_RX_FIFO0, &rx, data) != HAL_OK) {
+    if (frm->flags & GS_CAN_FLAG_TX_AT) {
+        uint16_t need = (uint16_t) (offsetof(struct gs_host_frame, data) + ((frm->flags & GS_CAN_FLAG_FD) ? 64U : 8U) +
+                                    sizeof(uint32_t));
+        if (len < need || gs_replay_push(frm, gs_usb_get_timestamp(frm)) != 0) {
+            gs_usb_tx_reject(buf, len);
+            return;
+        }
+        if (gs_replay_room() <= 1U) {
+            usb_ep1_out_hold();
+        }
         return;
     }
 
-    struct gs_host_frame frm = {0};
-    frm.echo_id = 0xFFFFFFFFU;
-    frm.can_id = rx.Identifier;
-    if (rx.IdType == FDCAN_EXTENDED_ID) {
-        frm.can_id |= CAN_EFF_FLAG;
+    int slot = (gs_usb_tx_queue_room(channel) == 0U) ? -1 : gs_usb_tx_slot_alloc(channel);
+    if (slot < 0) {
+        gs_usb_tx_reject(buf, len);
+        return;
     }
-    if (rx.RxFrameType == FDCAN_REMOTE_FRAME) {
-        frm.can_id |= CAN_RTR_FLAG;
+    memcpy(&gs_txq[channel].frm[slot], frm, sizeof(struct gs_host_frame));
+    gs_usb_tx_enqueue(channel, (uint8_t) slot, frm->reserved, 0);
+
+    gs_usb_tx_refill(channel);
+
+    /* NAK the host until gs_usb_poll() sees room again. One entry stays free for the
+     * packet that may already be arriving in the other EP1 OUT buffer. */
+    if (gs_usb_tx_queue_room(channel) <= 1U) {
+        usb_ep1_out_hold();
     }
-    frm.can_dlc = gs_usb_dlc_to_len(rx.DataLength);
-    frm.channel = (hfdcan == &hfdcan1) ? 0 : 1;
-    frm.flags = 0;
-    frm.reserved = 0;
-    uint8_t payload_len = gs_usb_dlc_to_len(rx.DataLength);
-    memcpy(frm.data, data, payload_len > 64 ? 64 : payload_len);
+}
 
-    frm.flags = 0;
-    if (rx.FDFormat == FDCAN_FD_CAN) {
-        frm.flags |= GS_CAN_FLAG_FD;
+/* Queue a frame from inside the device: urgent ones (cyclic scheduler, replay, gateway
+ * overflow) go ahead of host traffic in FIFO mode, others queue normally; priority mode
+ * orders both by ID. A
+ * frame with echo_id 0xFFFFFFFF is not echoed. Two entries are left for bulk OUT, which may
+ * have one packet in flight after it holds EP1 OUT. -1 when the channel is stopped, -2 when
+ * its queue is full. */
+int gs_usb_tx_inject(uint8_t channel, const struct gs_host_frame *frm, uint8_t urgent) {
+    if (channel >= NUM_CAN_CHANNELS || !gs_can_started[channel]) {
+        return -1;
+    }
+    if (gs_usb_tx_queue_room(channel) <= 2U) {
+        return -2;
     }
-    if (rx.BitRateSwitch == FDCAN_BRS_ON) {
-        frm.flags |= GS_CAN_FLAG_BRS;
+    int slot = gs_usb_tx_slot_alloc(channel);
+    if (slot < 0) {
+        return -2;
     }
+    memcpy(&gs_txq[channel].frm[slot], frm, sizeof(struct gs_host_frame));
+    gs_usb_tx_enqueue(channel, (uint8_t) slot, frm->reserved, urgent);
+    gs_usb_tx_refill(channel);
+    return 0;
+}
+
+/* Gateway output, called from the source channel's RX interrupt. The frame goes straight into
+ * the destination TX FIFO, ahead of queued host frames, and only falls back to the software
+ * queue when the FIFO is full. */
+void gs_usb_gateway_send(uint8_t channel, const struct gs_host_frame *frm) {
+    FDCAN_HandleTypeDef *hcan = gs_usb_get_can(channel);
+    if (hcan == NULL || channel >= NUM_CAN_CHANNELS || !gs_can_started[channel]) {
+        return;
+    }
+    /* A buffer released by an abort must be settled before it is written again */
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    gs_usb_tx_reap_aborts(channel, hcan);
+    int put = gs_mram_tx_put(hcan, frm, GS_USB_TX_MARKER_NONE);
+    __set_PRIMASK(primask);
+    if (put < 0) {
+        (void)gs_usb_tx_inject(channel, frm, 1);
+    }
+}
+
+/* Echo the frames whose TX event was lost (TEFL): their buffer is no longer pending but the
+ * slot would stay in flight until the next reset. Aborted frames are left to
+ * gs_usb_tx_reap_aborts(). Returns -1 when events arrived meanwhile and must be read first. */
+static int gs_usb_tx_recover_lost(uint8_t channel, FDCAN_HandleTypeDef *hcan) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint32_t pending = hcan->Instance->TXBRP;
+    if ((hcan->Instance->TXEFS & FDCAN_TXEFS_EFFL) != 0U) {
+        __set_PRIMASK(primask);
+        return -1;
+    }
+    uint32_t inhw = gs_tx_inhw[channel] & ~gs_tx_aborting[channel];
+    for (uint8_t slot = 0; slot < GS_USB_TX_ECHO_SLOTS; slot++) {
+        if ((inhw & (1UL << slot)) == 0U || (pending & (1UL << gs_tx_info[channel][slot].buf)) != 0U) {
+            continue;
+        }
+        gs_tx_inhw[channel] &= ~(1UL << slot);
+        gs_tx_echo[channel][slot].timestamp_us = gs_timer_now();
+        gs_usb_tx_done_push(channel, slot, 0);
+    }
+    __set_PRIMASK(primask);
+    return 0;
+}
+
+/* A TX event means the frame left the controller: stamp it and hand the echo to the main loop */
+void HAL_FDCAN_TxEventFifoCallback(FDCAN_HandleTypeDef *hfdcan, uint32_t TxEventFifoITs) {
+    uint8_t channel = gs_usb_get_channel(hfdcan);
+    uint8_t lost = ((TxEventFifoITs & FDCAN_IT_TX_EVT_FIFO_ELT_LOST) != 0U) ? 1U : 0U;
+    uint8_t slot;
+
+    if (lost) {
+        gs_tx_evt_lost[channel]++;
+    }
+
+    do {
+        while (gs_mram_tx_event_get(hfdcan, &slot) == 0) {
+            uint32_t now = gs_timer_now();
+            if (slot >= GS_USB_TX_ECHO_SLOTS || (gs_tx_echo_used[channel] & (1UL << slot)) == 0U) {
+                continue;
+            }
+
+            gs_tx_echo[channel][slot].timestamp_us = now;
+            uint32_t primask = __get_PRIMASK();
+            __disable_irq();
+            gs_tx_inhw[channel] &= ~(1UL << slot);
+            gs_tx_aborting[channel] &= ~(1UL << slot);
+            gs_usb_tx_done_push(channel, slot, 0);
+            __set_PRIMASK(primask);
+        }
+    } while (lost && gs_usb_tx_recover_lost(channel, hfdcan) != 0);
+
+    /* The event marks a finished transmission, so a TX FIFO element is free again */
+    gs_usb_tx_refill(channel);
+}
+
+/* Move every pending element of an RX FIFO into a raw queue in one pass.
+ * Conversion to host frames happens later in gs_usb_poll(). */
+static void gs_usb_drain_rx_fifo(FDCAN_HandleTypeDef *hfdcan, uint32_t fifo, struct gs_rx_queue *q) {
+    struct gs_mram_elem raw;
+    uint8_t channel = gs_usb_get_channel(hfdcan);
+    uint32_t pending = gs_mram_rx_level(hfdcan, fifo);
+
+    while (pending > 0U) {
+        /* Only this interrupt pops the channel's FIFO, the read needs no masking */
+        if (gs_mram_rx_read(hfdcan, fifo, &raw) != 0) {
+            return;
+        }
+        uint32_t now = gs_timer_now();
+
+        /* Route matching and copies run with interrupts enabled; frames only routed to
+         * another channel never take a queue slot */
+        if (gs_gateway_forward(channel, &raw)) {
+            uint32_t primask = __get_PRIMASK();
+            __disable_irq();
+            uint16_t head = q->head;
+            if ((uint16_t) (head - q->tail) > q->mask) {
+                q->overflow++;
+            } else {
+                struct gs_rx_elem *elem = &q->elem[head & q->mask];
+                elem->raw = raw;
+                elem->timestamp_us = now;
+                elem->channel = channel;
+                __DMB();
+                q->head = (uint16_t) (head + 1U);
+            }
+            __set_PRIMASK(primask);
+        }
 
-    usb_ep1_send((const uint8_t *) &frm, 16U + payload_len);
+        /* Pick up frames that landed while draining */
+        pending--;
+        if (pending == 0U) {
+            pending = gs_mram_rx_level(hfdcan, fifo);
+        }
+    }
+}
+
+static void gs_usb_drain_rx(FDCAN_HandleTypeDef *hfdcan) {
+    /* Priority traffic first, whichever FIFO raised the interrupt */
+    gs_usb_drain_rx_fifo(hfdcan, FDCAN_RX_FIFO1, &gs_rx_hi);
+    gs_usb_drain_rx_fifo(hfdcan, FDCAN_RX_FIFO0, &gs_rx_lo);
+}
+
+void HAL_FDCAN_RxFifo0Callback(FDCAN_HandleTypeDef *hfdcan, uint32_t RxFifo0ITs) {
+    if ((RxFifo0ITs & FDCAN_IT_RX_FIFO0_MESSAGE_LOST) != 0U) {
+        gs_rx_fifo_lost[gs_usb_get_channel(hfdcan)]++;
+    }
+
+    /* New message and FIFO full both just mean "drain everything" */
+    gs_usb_drain_rx(hfdcan);
+}
+
+void HAL_FDCAN_RxFifo1Callback(FDCAN_HandleTypeDef *hfdcan, uint32_t RxFifo1ITs) {
+    if ((RxFifo1ITs & FDCAN_IT_RX_FIFO1_MESSAGE_LOST) != 0U) {
+        gs_rx_fifo_lost[gs_usb_get_channel(hfdcan)]++;
+    }
+
+    gs_usb_drain_rx(hfdcan);
+}
+
+/* Fold a last error code (LEC/DLEC) into the pending error frame */
+static void gs_usb_err_code(struct gs_can_err *e, uint32_t code) {
+    switch (code) {
+        case 1U:
+            e->prot |= CAN_ERR_PROT_STUFF;
+            break;
+        case 2U:
+            e->prot |= CAN_ERR_PROT_FORM;
+            break;
+        case 3U:
+            e->ack = 1;
+            break;
+        case 4U:
+            e->prot |= CAN_ERR_PROT_BIT1;
+            break;
+        case 5U:
+            e->prot |= CAN_ERR_PROT_BIT0;
+            break;
+        case 6U:
+            e->loc = CAN_ERR_PROT_LOC_CRC_SEQ;
+            break;
+        default:
+            break; /* no error / no change since the last read */
+    }
+}
+
+/* Reading PSR resets LEC/DLEC, so both callbacks share this single read */
+static void gs_usb_err_sample(FDCAN_HandleTypeDef *hfdcan) {
+    uint8_t channel = gs_usb_get_channel(hfdcan);
+    struct gs_can_err *e = &gs_err[channel];
+    uint32_t psr = hfdcan->Instance->PSR;
+
+    uint8_t state = GS_CAN_STATE_ERROR_ACTIVE;
+    if (psr & FDCAN_PSR_BO) {
+        state = GS_CAN_STATE_BUS_OFF;
+    } else if (psr & FDCAN_PSR_EP) {
+        state = GS_CAN_STATE_ERROR_PASSIVE;
+    } else if (psr & FDCAN_PSR_EW) {
+        state = GS_CAN_STATE_ERROR_WARNING;
+    }
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    e->state = state;
+    if (e->berr) {
+        uint8_t prot = e->prot;
+        gs_usb_err_code(e, (psr & FDCAN_PSR_LEC) >> FDCAN_PSR_LEC_Pos);
+        gs_usb_err_code(e, (psr & FDCAN_PSR_DLEC) >> FDCAN_PSR_DLEC_Pos);
+        if (e->prot != prot && (psr & FDCAN_PSR_ACT) == FDCAN_PSR_ACT) {
+            e->prot |= CAN_ERR_PROT_TX;
+        }
+        CLEAR_BIT(hfdcan->Instance->IE, GS_USB_BERR_ITS);
+    }
+    e->pending = 1;
+    __set_PRIMASK(primask);
+}
+
+void HAL_FDCAN_ErrorStatusCallback(FDCAN_HandleTypeDef *hfdcan, uint32_t ErrorStatusITs) {
+    (void)ErrorStatusITs;
+    gs_usb_err_sample(hfdcan);
+}
+
+void HAL_FDCAN_ErrorCallback(FDCAN_HandleTypeDef *hfdcan) {
+    /* The HAL accumulates ErrorCode and calls back on every interrupt until it is cleared */
+    hfdcan->ErrorCode = HAL_FDCAN_ERROR_NONE;
+    gs_usb_err_sample(hfdcan);
+}
+
+static void gs_usb_build_rx_frame(struct gs_host_frame *frm, const struct gs_rx_elem *elem) {
+    gs_mram_rx_to_frame(&elem->raw, frm);
+    frm->channel = elem->channel;
+    frm->reserved = 0;
+    if (gs_hw_timestamp[elem->channel]) {
+        gs_usb_put_timestamp(frm, elem->timestamp_us);
+    }
+}
+
+/* Echoes first: the host holds a TX context for each of them */
+static void gs_usb_poll_echo(void) {
+    while (gs_tx_done_tail != gs_tx_done_head) {
+        if (usb_ep1_free_slots() == 0U) {
+            break;
+        }
+
+        uint16_t tail = gs_tx_done_tail;
+        __DMB();
+        uint8_t channel = gs_tx_done[tail & (GS_USB_TX_DONE_LEN - 1U)].channel;
+        uint8_t slot = gs_tx_done[tail & (GS_USB_TX_DONE_LEN - 1U)].slot;
+        uint8_t cancelled = gs_tx_done[tail & (GS_USB_TX_DONE_LEN - 1U)].cancelled;
+        gs_tx_done_tail = (uint16_t) (tail + 1U);
+        if ((gs_tx_echo_used[channel] & (1UL << slot)) == 0U) {
+            continue; /* channel was reset meanwhile */
+        }
+
+        struct gs_host_frame *frm = &gs_tx_echo[channel][slot];
+        frm->reserved = cancelled ? GS_TX_ECHO_CANCELLED : 0U;
+        if (cancelled) {
+            gs_err[channel].tx_timeout = 1;
+            gs_err[channel].pending = 1;
+        }
+        if (gs_hw_timestamp[channel]) {
+            gs_usb_put_timestamp(frm, frm->timestamp_us);
+        }
+        if (frm->echo_id != 0xFFFFFFFFU) {
+            usb_ep1_send((const uint8_t *) frm, gs_usb_frame_size(frm));
+        }
+        gs_usb_echo_free(channel, slot);
+        gs_usb_tx_refill(channel);
+    }
+}
+
+/* Abort frames still in a TX buffer past their deadline. Completion is picked up by
+ * gs_usb_tx_refill(), which also drops expired frames from the software queue. */
+static void gs_usb_poll_deadline(void) {
+    for (uint8_t ch = 0; ch < NUM_CAN_CHANNELS; ch++) {
+        if (!gs_can_started[ch]) {
+            continue;
+        }
+        FDCAN_HandleTypeDef *hcan = gs_usb_get_can(ch);
+        uint32_t now = gs_timer_now();
+
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        uint32_t live = gs_tx_inhw[ch] & gs_tx_timed[ch] & ~gs_tx_aborting[ch];
+        for (uint8_t slot = 0; live != 0U && slot < GS_USB_TX_ECHO_SLOTS; slot++) {
+            if ((live & (1UL << slot)) == 0U) {
+                continue;
+            }
+            live &= ~(1UL << slot);
+            if ((int32_t) (now - gs_tx_info[ch][slot].deadline_us) >= 0) {
+                (void)HAL_FDCAN_AbortTxRequest(hcan, 1UL << gs_tx_info[ch][slot].buf);
+                gs_tx_aborting[ch] |= 1UL << slot;
+            }
+        }
+        uint8_t check = (gs_tx_aborting[ch] != 0U || gs_txq[ch].timed != 0U) ? 1U : 0U;
+        __set_PRIMASK(primask);
+
+        if (check) {
+            gs_usb_tx_refill(ch);
+        }
+    }
+}
+
+/* Controller status bits for a state, split by which counter crossed the limit */
+static uint8_t gs_usb_err_ctrl(uint8_t state, uint32_t tec, uint32_t rec) {
+    uint8_t limit = (state == GS_CAN_STATE_ERROR_PASSIVE) ? 128U : 96U;
+    uint8_t tx = (state == GS_CAN_STATE_ERROR_PASSIVE) ? CAN_ERR_CRTL_TX_PASSIVE : CAN_ERR_CRTL_TX_WARNING;
+    uint8_t rx = (state == GS_CAN_STATE_ERROR_PASSIVE) ? CAN_ERR_CRTL_RX_PASSIVE : CAN_ERR_CRTL_RX_WARNING;
+    uint8_t ctrl = 0;
+
+    if (state == GS_CAN_STATE_ERROR_ACTIVE) {
+        return CAN_ERR_CRTL_ACTIVE;
+    }
+    if (tec >= limit) {
+        ctrl |= tx;
+    }
+    if (rec >= limit) {
+        ctrl |= rx;
+    }
+    if (ctrl == 0U) {
+        ctrl = (tec >= rec) ? tx : rx;
+    }
+    return ctrl;
+}
+
+static void gs_usb_poll_err(void) {
+    for (uint8_t ch = 0; ch < NUM_CAN_CHANNELS; ch++) {
+        struct gs_can_err *e = &gs_err[ch];
+        if (!e->pending || !gs_can_started[ch]) {
+            continue;
+        }
+        uint32_t now = gs_timer_now();
+        if ((uint32_t) (now - e->last_us) < GS_USB_ERR_INTERVAL_US) {
+            continue;
+        }
+        struct gs_host_frame *frm = (struct gs_host_frame *) usb_ep1_reserve();
+        if (frm == NULL) {
+            return;
+        }
+
+        FDCAN_HandleTypeDef *hcan = gs_usb_get_can(ch);
+        uint32_t primask = __get_PRIMASK();
+        __disable_irq();
+        uint8_t state = e->state;
+        uint8_t prot = e->prot;
+        uint8_t loc = e->loc;
+        uint8_t ack = e->ack;
+        e->prot = 0;
+        e->loc = 0;
+        e->ack = 0;
+        e->pending = 0;
+        if (e->berr) {
+            SET_BIT(hcan->Instance->IE, GS_USB_BERR_ITS);
+        }
+        __set_PRIMASK(primask);
+
+        FDCAN_ErrorCountersTypeDef ec;
+        (void)HAL_FDCAN_GetErrorCounters(hcan, &ec);
+
+        memset(frm, 0, offsetof(struct gs_host_frame, data) + 8U);
+        uint32_t can_id = CAN_ERR_FLAG | CAN_ERR_CNT;
+        if (e->restarted) {
+            can_id |= CAN_ERR_RESTARTED;
+            e->restarted = 0;
+        }
+        if (e->tx_timeout) {
+            can_id |= CAN_ERR_TX_TIMEOUT;
+            e->tx_timeout = 0;
+        }
+        if (state != e->reported) {
+            if (state == GS_CAN_STATE_BUS_OFF) {
+                can_id |= CAN_ERR_BUSOFF;
+            } else {
+                can_id |= CAN_ERR_CRTL;
+                frm->data[1] = gs_usb_err_ctrl(state, ec.TxErrorCnt, ec.RxErrorCnt);
+            }
+            e->reported = state;
+        }
+        if (prot != 0U || loc != 0U) {
+            can_id |= CAN_ERR_PROT | CAN_ERR_BUSERROR;
+            frm->data[2] = prot;
+            frm->data[3] = loc;
+        }
+        if (ack) {
+            can_id |= CAN_ERR_ACK | CAN_ERR_BUSERROR;
+        }
+        frm->data[6] = (uint8_t) ec.TxErrorCnt;
+        frm->data[7] = (uint8_t) ec.RxErrorCnt;
+
+        frm->echo_id = 0xFFFFFFFFU;
+        frm->can_id = can_id;
+        frm->can_dlc = CAN_ERR_DLC;
+        frm->channel = ch;
+        if (gs_hw_timestamp[ch]) {
+            gs_usb_put_timestamp(frm, now);
+        }
+        usb_ep1_commit(gs_usb_frame_size(frm));
+        e->last_us = now;
+    }
+}
+
+/* The controller sets INIT on bus-off; clearing it starts the 128 x 11 recessive bit
+ * recovery sequence. The bus-off entry and the restart both go to the host as error frames. */
+static void gs_usb_poll_busoff(void) {
+    for (uint8_t ch = 0; ch < NUM_CAN_CHANNELS; ch++) {
+        struct gs_can_busoff *b = &gs_busoff[ch];
+        if (!gs_can_started[ch] || b->policy.mode != GS_BUSOFF_AUTO) {
+            continue;
+        }
+        uint32_t now = gs_timer_now();
+        uint8_t busoff = (gs_err[ch].state == GS_CAN_STATE_BUS_OFF) ? 1U : 0U;
+
+        if (b->restarting) {
+            if (!busoff) {
+                b->restarting = 0;
+                b->since_us = now;
+                gs_err[ch].restarted = 1;
+                gs_err[ch].pending = 1;
+            }
+            continue;
+        }
+        if (!busoff) {
+            /* Stable on the bus again: forget the back-off */
+            if (b->delay_us != b->policy.delay_us && (uint32_t) (now - b->since_us) >= b->policy.max_delay_us) {
+                b->delay_us = b->policy.delay_us;
+            }
+            continue;
+        }
+        if (!b->waiting) {
+            b->waiting = 1;
+            b->since_us = now;
+        }
+        if ((uint32_t) (now - b->since_us) < b->delay_us) {
+            continue;
+        }
+
+        CLEAR_BIT(gs_usb_get_can(ch)->Instance->CCCR, FDCAN_CCCR_INIT);
+        b->waiting = 0;
+        b->restarting = 1;
+        b->delay_us = (b->delay_us > b->policy.max_delay_us / 2U) ? b->policy.max_delay_us : b->delay_us * 2U;
+    }
+}
+
+void gs_usb_poll(void) {
+    gs_usb_poll_echo();
+    gs_usb_poll_deadline();
+    gs_usb_poll_busoff();
+    gs_usb_poll_err();
+
+    if (usb_ep1_out_is_held()) {
+        uint8_t room = (gs_replay_room() > 1U) ? 1U : 0U;
+        for (uint8_t ch = 0; ch < NUM_CAN_CHANNELS; ch++) {
+            if (gs_usb_tx_queue_room(ch) <= 1U) {
+                room = 0;
+            }
+        }
+        if (room) {
+            usb_ep1_out_resume();
+        }
+    }
+
+    for (;;) {
+        struct gs_rx_queue *q = (gs_rx_hi.tail != gs_rx_hi.head) ? &gs_rx_hi : &gs_rx_lo;
+        if (q->tail == q->head) {
+            break;
+        }
+        /* Build straight into the EP1 IN slot; leave frames queued while it is backed up */
+        struct gs_host_frame *frm = (struct gs_host_frame *) usb_ep1_reserve();
+        if (frm == NULL) {
+            break;
+        }
+
+        uint16_t tail = q->tail;
+        __DMB();
+        gs_usb_build_rx_frame(frm, &q->elem[tail & q->mask]);
+        __DMB();
+        q->tail = (uint16_t) (tail + 1U);
+
+        usb_ep1_commit(gs_usb_frame_size(frm));
+    }
 }
 
 const usb_app_ops_t gs_usb_ops = {
@@ -8,6 +8,7 @@
 #define GS_CAN_FEATURE_LOOP_BACK (1 << 1)
 #define GS_CAN_FEATURE_TRIPLE_SAMPLE (1 << 2)
 #define GS_CAN_FEATURE_ONE_SHOT (1 << 3)
+#define GS_CAN_FEATURE_HW_TIMESTAMP (1 << 4)
 #define GS_CAN_FEATURE_FD (1 << 8)
 #define GS_CAN_FEATURE_BT_CONST_EXT (1 << 10)
 #define GS_CAN_FEATURE_BERR_REPORTING (1 << 12)
@@ -30,6 +31,21 @@ enum {
     GS_USB_BREQ_GET_TERMINATION,
     GS_USB_BREQ_GET_STATE,
 };
+
+/* Device-specific vendor requests, kept clear of the kernel driver's range */
+enum {
+    GS_USB_BREQ_EXT_STATS = 0x40,       /* IN, wIndex: channel, returns gs_device_stats */
+    GS_USB_BREQ_EXT_RX_BATCH,           /* wValue: 1 = pack several frames per bulk IN transfer */
+    GS_USB_BREQ_EXT_PRIO_FILTER,        /* wIndex: channel, wValue: first entry, data: gs_prio_filter[] */
+    GS_USB_BREQ_EXT_FILTER,             /* wIndex: channel, wValue: first entry, data: gs_device_filter[] */
+    GS_USB_BREQ_EXT_BUSOFF,             /* wIndex: channel, data: gs_busoff_policy */
+    GS_USB_BREQ_EXT_TX_MODE,            /* wIndex: channel, wValue: GS_TX_MODE_* */
+    GS_USB_BREQ_EXT_CYCLIC,             /* wIndex: channel, wValue: entry, data: gs_cyclic_msg */
+    GS_USB_BREQ_EXT_GATEWAY,            /* wIndex: source channel, wValue: first entry, data: gs_gateway_route[] */
+};
+
+#define GS_TX_MODE_FIFO 0     /* frames go out in the order the host sent them */
+#define GS_TX_MODE_PRIORITY 1 /* lowest CAN ID first, in software and in the controller */
 /* ===== Device info ===== */
 struct gs_usb_device_config {
     uint8_t reserved1;
@@ -92,7 +108,13 @@ struct gs_device_state {
 
 #define GS_CAN_MODE_RESET 0
 #define GS_CAN_MODE_START 1
+#define GS_CAN_MODE_LISTEN_ONLY (1 << 0) /* flags */
+#define GS_CAN_MODE_LOOP_BACK (1 << 1)
+#define GS_CAN_MODE_TRIPLE_SAMPLE (1 << 2)
+#define GS_CAN_MODE_ONE_SHOT (1 << 3)
+#define GS_CAN_MODE_HW_TIMESTAMP (1 << 4)
 #define GS_CAN_MODE_FD (1 << 8)
+#define GS_CAN_MODE_BERR_REPORTING (1 << 12)
 
 #define GS_CAN_STATE_ERROR_ACTIVE 0
 #define GS_CAN_STATE_ERROR_WARNING 1
@@ -109,17 +131,139 @@ struct gs_device_state {
 #define CAN_RTR_FLAG 0x40000000U
 #define CAN_ERR_FLAG 0x20000000U
 
+/* Error frame classes (can_id) and data bytes, as in linux/can/error.h */
+#define CAN_ERR_DLC 8
+#define CAN_ERR_TX_TIMEOUT 0x00000001U
+#define CAN_ERR_CRTL 0x00000004U
+#define CAN_ERR_PROT 0x00000008U
+#define CAN_ERR_ACK 0x00000020U
+#define CAN_ERR_BUSOFF 0x00000040U
+#define CAN_ERR_BUSERROR 0x00000080U
+#define CAN_ERR_RESTARTED 0x00000100U
+#define CAN_ERR_CNT 0x00000200U
+
+#define CAN_ERR_CRTL_RX_WARNING 0x04 /* data[1] */
+#define CAN_ERR_CRTL_TX_WARNING 0x08
+#define CAN_ERR_CRTL_RX_PASSIVE 0x10
+#define CAN_ERR_CRTL_TX_PASSIVE 0x20
+#define CAN_ERR_CRTL_ACTIVE 0x40
+
+#define CAN_ERR_PROT_FORM 0x02 /* data[2] */
+#define CAN_ERR_PROT_STUFF 0x04
+#define CAN_ERR_PROT_BIT0 0x08
+#define CAN_ERR_PROT_BIT1 0x10
+#define CAN_ERR_PROT_TX 0x80
+
+#define CAN_ERR_PROT_LOC_CRC_SEQ 0x08 /* data[3] */
+
+#define GS_CAN_FLAG_OVERFLOW (1 << 0)
 #define GS_CAN_FLAG_FD (1 << 1)
 #define GS_CAN_FLAG_BRS (1 << 2)
 #define GS_CAN_FLAG_ESI (1 << 3)
+#define GS_CAN_FLAG_TX_AT (1 << 7) /* device-specific: TX at the device time after the data area */
+
+
+/* Priority ID set: matching frames use RX FIFO1 and reach the host first.
+ * can_id/mask use the SocketCAN layout, CAN_EFF_FLAG selects an extended ID. */
+struct gs_prio_filter {
+    uint32_t can_id;
+    uint32_t can_mask;
+} __attribute__((packed));
+
+#define GS_USB_MAX_PRIO_FILTERS 16
+
+/* Acceptance filter element. Once any is configured, frames matching none are rejected in hardware. */
+#define GS_FILTER_TYPE_MASK 0  /* id1 = ID, id2 = mask */
+#define GS_FILTER_TYPE_RANGE 1 /* id1..id2 inclusive */
+#define GS_FILTER_TYPE_DUAL 2  /* id1 or id2 */
+
+#define GS_FILTER_TO_FIFO0 0
+#define GS_FILTER_TO_FIFO1 1 /* same treatment as the priority ID set */
+#define GS_FILTER_REJECT 2
+
+struct gs_device_filter {
+    uint8_t type;
+    uint8_t action;
+    uint8_t reserved[2];
+    uint32_t id1; /* CAN_EFF_FLAG in id1 selects an extended element */
+    uint32_t id2;
+} __attribute__((packed));
 
+#define GS_USB_MAX_FILTERS 36 /* 28 standard + 8 extended elements on STM32G0 */
+
+/* Bus-off handling. With GS_BUSOFF_AUTO the device restarts the controller by itself after
+ * delay_us; each further bus-off doubles the wait up to max_delay_us, and the wait falls back
+ * to delay_us once the channel has stayed on the bus for max_delay_us. */
+#define GS_BUSOFF_MANUAL 0 /* stay bus-off until the host resets the channel */
+#define GS_BUSOFF_AUTO 1
+
+struct gs_busoff_policy {
+    uint8_t mode;
+    uint8_t reserved[3];
+    uint32_t delay_us;
+    uint32_t max_delay_us;
+} __attribute__((packed));
+
+/* Periodic frame sent by the device itself. Only the payload bytes covered by can_dlc need to
+ * be sent; the 64-byte control transfer limits payloads to 48 bytes (DLC 14). */
+#define GS_CYCLIC_NO_BYTE 0xFF
+
+struct gs_cyclic_msg {
+    uint32_t can_id;
+    uint32_t period_us;   /* 0 disables the entry */
+    uint32_t offset_us;   /* first send, relative to upload or channel start */
+    uint8_t can_dlc;
+    uint8_t flags;        /* GS_CAN_FLAG_FD / GS_CAN_FLAG_BRS */
+    uint8_t counter_pos;  /* payload byte incremented before each send, or GS_CYCLIC_NO_BYTE */
+    uint8_t checksum_pos; /* payload byte set to the 8-bit sum of the others, or GS_CYCLIC_NO_BYTE */
+    uint8_t data[48];
+} __attribute__((packed));
+
+/* Gateway route: frames received on the source channel that match can_id/can_mask (SocketCAN
+ * layout, CAN_EFF_FLAG must match) are sent on dst_channel from the RX interrupt */
+#define GS_GW_REWRITE (1 << 0)    /* replace the can_id bits in new_mask with new_id */
+#define GS_GW_TO_FD (1 << 1)      /* send as CAN FD; remote frames stay classic */
+#define GS_GW_TO_CLASSIC (1 << 2) /* send as classic CAN; payloads over 8 bytes are dropped */
+#define GS_GW_BRS (1 << 3)        /* with GS_GW_TO_FD: bit rate switch on */
+#define GS_GW_MIRROR (1 << 4)     /* still deliver the frame to the host */
+
+struct gs_gateway_route {
+    uint32_t can_id;
+    uint32_t can_mask;
+    uint32_t new_id;
+    uint32_t new_mask; /* may include CAN_EFF_FLAG to switch between standard and extended */
+    uint8_t dst_channel;
+    uint8_t flags;
+    uint8_t reserved[2];
+} __attribute__((packed));
+
+/* Counters since power-up. The EP1 IN, raw RX queue and bulk OUT counters are shared by
+ * all channels, the FDCAN FIFO ones belong to the channel in wIndex. */
+struct gs_device_stats {
+    uint32_t in_queued;     /* frames accepted into the EP1 IN ring */
+    uint32_t in_overflow;   /* frames dropped because the EP1 IN ring was full */
+    uint32_t in_transfers;  /* bulk IN transfers started */
+    uint32_t in_high_water; /* max EP1 IN ring occupancy seen */
+    uint32_t rx_overflow;   /* frames dropped because the raw RX queues were full */
+    uint32_t rx_fifo_lost;  /* frames lost in the FDCAN RX FIFOs */
+    uint32_t tx_evt_lost;   /* TX events lost in the FDCAN TX event FIFO */
+    uint32_t tx_rejected;   /* host frames refused at bulk OUT, echoed with GS_CAN_FLAG_OVERFLOW */
+} __attribute__((packed));
 
 #define NUM_CAN_CHANNELS 2
 #if NUM_CAN_CHANNELS > 3
 #error "NUM_CAN_CHANNELS max is 3 for gs_usb"
 #endif
 
-/* Bulk data frame (classic/FD) */
+/* Bulk data frame (classic/FD). With GS_CAN_MODE_HW_TIMESTAMP a 32-bit microsecond
+ * timestamp follows the data area: at data[8] for classic frames, timestamp_us for FD.
+ * On TX, a non-zero reserved byte is a deadline in ms from arrival; a frame not on the wire
+ * by then is dropped, echoed with reserved = GS_TX_ECHO_CANCELLED and reported as a
+ * CAN_ERR_TX_TIMEOUT error frame. With GS_CAN_FLAG_TX_AT the u32 in the timestamp position is
+ * the device time (GS_USB_BREQ_TIMESTAMP clock) at which the frame is released to the
+ * controller. */
+#define GS_TX_ECHO_CANCELLED 0xFF
+
 struct gs_host_frame {
     uint32_t echo_id;
     uint32_t can_id;
@@ -128,9 +272,13 @@ struct gs_host_frame {
     uint8_t flags;
     uint8_t reserved;
     uint8_t data[64];
+    uint32_t timestamp_us;
 } __attribute__((packed));
 
 int usb_handle_gs_usb_request(const usb_setup_pkt_t *req, const uint8_t *data, uint16_t len);
-void gs_usb_handle_bulk_out(uint16_t len);
+void gs_usb_handle_bulk_out(const uint8_t *buf, uint16_t len);
+void gs_usb_poll(void);
+int gs_usb_tx_inject(uint8_t channel, const struct gs_host_frame *frm, uint8_t urgent);
+void gs_usb_gateway_send(uint8_t channel, const struct gs_host_frame *frm);
 extern const usb_app_ops_t gs_usb_ops;
 #endif
@@ -15,17 +15,48 @@ volatile uint16_t ep0_tx_len;
 volatile uint8_t ep0_rx_buf[USB_EP0_BUF_SIZE]={0};
 
 /* EP1 buffers */
-volatile uint8_t ep1_tx_buf[USB_EP1_BUF_SIZE] = {0};
-volatile uint8_t ep1_rx_buf[USB_EP1_BUF_SIZE] = {0};
+/* EP1 OUT ping-pong: the hardware fills one buffer while the other is handled */
+volatile uint8_t ep1_rx_buf[2][USB_EP1_BUF_SIZE] = {0};
+static volatile uint8_t ep1_rx_idx = 0;
 static volatile uint8_t ep1_in_busy = 0;
-static uint8_t ep1_pending_buf[USB_EP1_BUF_SIZE];
-static volatile uint16_t ep1_pending_len = 0;
+
+/* EP1 IN ring: head is advanced by usb_ep1_commit(), tail by usb_ep1_tx_complete().
+ * Both are free-running and masked on access. */
+static usb_ep1_slot_t ep1_tx_ring[USB_EP1_TX_RING_LEN];
+static volatile uint16_t ep1_tx_head = 0;
+static volatile uint16_t ep1_tx_tail = 0;
+static volatile usb_ep1_stats_t ep1_tx_stats = {0};
+
+/* Batching packs several slots into one transfer; only the consumer touches these.
+ * Packets are gathered from the ring straight into packet memory, slot by slot. */
+static volatile uint8_t ep1_batching = 0;
+static volatile uint16_t ep1_tx_inflight = 0;
+static volatile uint8_t ep1_tx_zlp = 0;
+static uint16_t ep1_xfer_left = 0;
+static uint16_t ep1_pkt_slot = 0;
+static uint16_t ep1_pkt_off = 0;
+
+/* EP1 OUT is left un-armed (NAKing) while the application holds it */
+static volatile uint8_t ep1_out_held = 0;
 __attribute__((weak)) const usb_app_ops_t *usb_app_ops = NULL;
 
+static void usb_ep1_out_arm(void);
+
+/* Class/vendor OUT requests with a data stage are run by usb_ep0_poll() in thread context.
+ * The status stage is NAKed until the handler returns, so slow work stays out of the USB IRQ. */
+static volatile uint8_t ep0_deferred = 0;
+static volatile uint8_t ep0_setup_seq = 0;
+static usb_setup_pkt_t ep0_deferred_setup;
+static uint8_t ep0_deferred_buf[USB_EP0_BUF_SIZE];
+static uint16_t ep0_deferred_len = 0;
+
 /* ---------- EP0 SETUP entry ---------- */
 void usb_ep0_setup(const usb_setup_pkt_t *req) {
     ep0_last_setup = *req;
-    
+    /* A new SETUP supersedes any request still waiting for its status stage */
+    ep0_setup_seq++;
+    ep0_deferred = 0;
+
     HAL_GPIO_WritePin(GPIOA, GPIO_PIN_1, GPIO_PIN_SET);
     switch (req->bmRequestType & 0x60) {
         case USB_REQ_TYPE_STANDARD:
@@ -168,11 +199,14 @@ void usb_ep0_handle_standard(const usb_setup_pkt_t *req) {
             uint8_t cfg = req->wValue & 0xFF;
 
             if (cfg == 1) {
+                usb_ep1_reset();
+                ep1_out_held = 0;
+                ep1_rx_idx = 0;
                 HAL_PCD_EP_Open(&hpcd_USB_DRD_FS, 0x01, 64, USB_EP_TYPE_BULK);
                 HAL_PCD_EP_Open(&hpcd_USB_DRD_FS, 0x81, 64, USB_EP_TYPE_BULK);
 
                 /* Prime EP1 OUT to receive data */
-                HAL_PCD_EP_Receive(&hpcd_USB_DRD_FS, 0x01, (uint8_t *) ep1_rx_buf, USB_EP1_BUF_SIZE);
+                usb_ep1_out_arm();
             } else if (cfg == 0) {
                 HAL_PCD_EP_Close(&hpcd_USB_DRD_FS, 0x01);
                 HAL_PCD_EP_Close(&hpcd_USB_DRD_FS, 0x81);
@@ -196,48 +230,288 @@ void usb_ep0_handle_standard(const usb_setup_pkt_t *req) {
     }
 }
 
+/* Load the next packet of the current transfer into EP1 IN packet memory and hand it to the
+ * host. Ring slots are word aligned, so whole words are moved while the source stays aligned. */
+static void usb_ep1_write_packet(void) {
+    PCD_EPTypeDef *ep = &hpcd_USB_DRD_FS.IN_ep[1];
+    __IO uint32_t *dst = (__IO uint32_t *) (USB_DRD_PMAADDR + (uint32_t) ep->pmaadress);
+    uint16_t pkt = (ep1_xfer_left > USB_EP1_MAX_PACKET) ? USB_EP1_MAX_PACKET : ep1_xfer_left;
+    uint16_t left = pkt;
+    uint32_t acc = 0;
+    uint8_t nacc = 0;
+
+    while (left > 0U) {
+        const usb_ep1_slot_t *slot =
+            &ep1_tx_ring[(uint16_t) (ep1_tx_tail + ep1_pkt_slot) & (USB_EP1_TX_RING_LEN - 1U)];
+        uint16_t n = (uint16_t) (slot->len - ep1_pkt_off);
+        if (n > left) {
+            n = left;
+        }
+        const uint8_t *src = &slot->data[ep1_pkt_off];
+        uint16_t i = 0;
+
+        if (nacc == 0U && (ep1_pkt_off & 3U) == 0U) {
+            for (; i + 4U <= n; i += 4U) {
+                *dst++ = *(const uint32_t *) &src[i];
+            }
+        }
+        for (; i < n; i++) {
+            acc |= (uint32_t) src[i] << (8U * nacc);
+            if (++nacc == 4U) {
+                *dst++ = acc;
+                acc = 0;
+                nacc = 0;
+            }
+        }
+
+        left = (uint16_t) (left - n);
+        ep1_pkt_off = (uint16_t) (ep1_pkt_off + n);
+        if (ep1_pkt_off == slot->len) {
+            ep1_pkt_slot++;
+            ep1_pkt_off = 0;
+        }
+    }
+    if (nacc != 0U) {
+        *dst = acc;
+    }
+
+    ep1_xfer_left = (uint16_t) (ep1_xfer_left - pkt);
+    /* One packet per HAL transfer: the IN interrupt then reports completion right away */
+    ep->xfer_len = 0;
+    PCD_SET_EP_TX_CNT(hpcd_USB_DRD_FS.Instance, ep->num, pkt);
+    PCD_SET_EP_TX_STATUS(hpcd_USB_DRD_FS.Instance, ep->num, USB_EP_TX_VALID);
+}
+
+/* Start a transfer from the ring tail. EP1 IN must be marked busy and the ring non-empty. */
+static void usb_ep1_start(void) {
+    uint16_t tail = ep1_tx_tail;
+    uint16_t head = ep1_tx_head;
+    uint16_t len = 0;
+    uint16_t n = 0;
+
+    /* Slots in [tail, head) belong to the consumer, so read them without masking */
+    ep1_tx_stats.transfers++;
+    while ((uint16_t) (tail + n) != head) {
+        const usb_ep1_slot_t *slot = &ep1_tx_ring[(uint16_t) (tail + n) & (USB_EP1_TX_RING_LEN - 1U)];
+        if (n > 0U && (!ep1_batching || len + slot->len > USB_EP1_BATCH_SIZE)) {
+            break;
+        }
+        len = (uint16_t) (len + slot->len);
+        n++;
+    }
+
+    ep1_tx_inflight = n;
+    ep1_xfer_left = len;
+    ep1_pkt_slot = 0;
+    ep1_pkt_off = 0;
+    /* A transfer that ends on a packet boundary needs a ZLP to terminate it */
+    ep1_tx_zlp = ((len % USB_EP1_MAX_PACKET) == 0U) ? 1U : 0U;
+    usb_ep1_write_packet();
+}
+
+/* Claim the head slot so a frame can be built in place. Thread context only: the slot is not
+ * visible to the consumer until usb_ep1_commit(). Returns NULL while the ring is full. */
+uint8_t *usb_ep1_reserve(void) {
+    uint16_t head = ep1_tx_head;
+    if ((uint16_t) (head - ep1_tx_tail) >= USB_EP1_TX_RING_LEN) {
+        return NULL;
+    }
+    return ep1_tx_ring[head & (USB_EP1_TX_RING_LEN - 1U)].data;
+}
+
+void usb_ep1_commit(uint16_t len) {
+    if (len > USB_EP1_TX_SLOT_SIZE) {
+        len = USB_EP1_TX_SLOT_SIZE;
+    }
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    uint16_t head = ep1_tx_head;
+    uint16_t used = (uint16_t) (head - ep1_tx_tail);
+    ep1_tx_ring[head & (USB_EP1_TX_RING_LEN - 1U)].len = len;
+    ep1_tx_head = (uint16_t) (head + 1U);
+
+    ep1_tx_stats.queued++;
+    if (used + 1U > ep1_tx_stats.high_water) {
+        ep1_tx_stats.high_water = (uint16_t) (used + 1U);
+    }
+
+    if (!ep1_in_busy) {
+        ep1_in_busy = 1;
+        usb_ep1_start();
+    }
+    __set_PRIMASK(primask);
+}
+
 int usb_ep1_send(const uint8_t *buf, uint16_t len) {
-    if (len > USB_EP1_BUF_SIZE) {
-        len = USB_EP1_BUF_SIZE;
+    if (len > USB_EP1_TX_SLOT_SIZE) {
+        len = USB_EP1_TX_SLOT_SIZE;
     }
-    if (ep1_in_busy) {
-        memcpy(ep1_pending_buf, buf, len);
-        ep1_pending_len = len;
-        return 1;
+
+    uint8_t *dst = usb_ep1_reserve();
+    if (dst == NULL) {
+        ep1_tx_stats.overflow++;
+        return -1;
     }
-    memcpy((uint8_t *) ep1_tx_buf, buf, len);
-    ep1_in_busy = 1;
-    HAL_PCD_EP_Transmit(&hpcd_USB_DRD_FS, 0x81, (uint8_t *) ep1_tx_buf, len);
+    memcpy(dst, buf, len);
+    usb_ep1_commit(len);
     return 0;
 }
 
 void usb_ep1_tx_complete(void) {
-    if (ep1_pending_len > 0) {
-        uint16_t len = ep1_pending_len;
-        memcpy((uint8_t *) ep1_tx_buf, ep1_pending_buf, len);
-        ep1_pending_len = 0;
-        ep1_in_busy = 1;
-        HAL_PCD_EP_Transmit(&hpcd_USB_DRD_FS, 0x81, (uint8_t *) ep1_tx_buf, len);
+    if (!ep1_in_busy) {
+        return;
+    }
+
+    /* Packets of the current transfer still to go */
+    if (ep1_xfer_left != 0U) {
+        usb_ep1_write_packet();
         return;
     }
+
+    if (ep1_tx_inflight != 0U) {
+        /* Release the slots covered by the finished transfer */
+        ep1_tx_tail = (uint16_t) (ep1_tx_tail + ep1_tx_inflight);
+        ep1_tx_inflight = 0;
+
+        if (ep1_tx_zlp) {
+            ep1_tx_zlp = 0;
+            usb_ep1_write_packet();
+            return;
+        }
+    }
+
+    /* Going idle must not race with a producer that saw us busy */
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (ep1_tx_tail == ep1_tx_head) {
+        ep1_in_busy = 0;
+        __set_PRIMASK(primask);
+        return;
+    }
+    __set_PRIMASK(primask);
+
+    usb_ep1_start();
+}
+
+void usb_ep1_reset(void) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    ep1_tx_tail = ep1_tx_head;
+    ep1_tx_inflight = 0;
+    ep1_tx_zlp = 0;
+    ep1_xfer_left = 0;
     ep1_in_busy = 0;
+    __set_PRIMASK(primask);
 }
 
-void usb_ep0_handle_out_data(uint16_t len) {
-    uint8_t type = ep0_last_setup.bmRequestType & 0x60;
-    if (type == USB_REQ_TYPE_CLASS) {
-        if (usb_app_ops && usb_app_ops->class_handler) {
-            (void)usb_app_ops->class_handler((const usb_setup_pkt_t *)&ep0_last_setup,
-                                             (const uint8_t *) ep0_rx_buf,
-                                             len);
+static void usb_ep1_out_arm(void) {
+    HAL_PCD_EP_Receive(&hpcd_USB_DRD_FS, 0x01, (uint8_t *) ep1_rx_buf[ep1_rx_idx], USB_EP1_BUF_SIZE);
+}
+
+/* EP1 OUT transfer done: re-arm into the other buffer first, then hand back the filled one */
+const uint8_t *usb_ep1_out_complete(void) {
+    const uint8_t *filled = (const uint8_t *) ep1_rx_buf[ep1_rx_idx];
+    ep1_rx_idx ^= 1U;
+    if (!ep1_out_held) {
+        usb_ep1_out_arm();
+    }
+    return filled;
+}
+
+/* Called from the EP1 OUT handler: stop re-arming, so the host is NAKed. A packet already
+ * landing in the other buffer is still delivered. */
+void usb_ep1_out_hold(void) {
+    ep1_out_held = 1;
+}
+
+uint8_t usb_ep1_out_is_held(void) {
+    return ep1_out_held;
+}
+
+/* Called from thread context; the USB interrupt is masked while re-arming */
+void usb_ep1_out_resume(void) {
+    HAL_NVIC_DisableIRQ(USB_UCPD1_2_IRQn);
+    if (ep1_out_held) {
+        ep1_out_held = 0;
+        if (usb_configuration == 1) {
+            usb_ep1_out_arm();
         }
-    } else if (type == USB_REQ_TYPE_VENDOR) {
-        if (usb_app_ops && usb_app_ops->vendor_handler) {
-            (void)usb_app_ops->vendor_handler((const usb_setup_pkt_t *)&ep0_last_setup,
-                                              (const uint8_t *) ep0_rx_buf,
-                                              len);
+    }
+    HAL_NVIC_EnableIRQ(USB_UCPD1_2_IRQn);
+}
+
+uint16_t usb_ep1_free_slots(void) {
+    return (uint16_t) (USB_EP1_TX_RING_LEN - (uint16_t) (ep1_tx_head - ep1_tx_tail));
+}
+
+void usb_ep1_set_batching(uint8_t enable) {
+    /* Takes effect from the next transfer */
+    ep1_batching = enable ? 1U : 0U;
+}
+
+void usb_ep1_get_stats(usb_ep1_stats_t *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    stats->queued = ep1_tx_stats.queued;
+    stats->overflow = ep1_tx_stats.overflow;
+    stats->high_water = ep1_tx_stats.high_water;
+    stats->transfers = ep1_tx_stats.transfers;
+    __set_PRIMASK(primask);
+}
+
+/* Data OUT stage done: queue the request for usb_ep0_poll(), which sends the status stage */
+void usb_ep0_handle_out_data(uint16_t len) {
+    if (len > USB_EP0_BUF_SIZE) {
+        len = USB_EP0_BUF_SIZE;
+    }
+    ep0_deferred_setup = *(const usb_setup_pkt_t *) &ep0_last_setup;
+    memcpy(ep0_deferred_buf, (const uint8_t *) ep0_rx_buf, len);
+    ep0_deferred_len = len;
+    ep0_deferred = 1;
+}
+
+/* Called from the main loop. The USB IRQ is only masked while the request is picked up and
+ * while the status stage is queued, not while the handler runs. */
+void usb_ep0_poll(void) {
+    if (!ep0_deferred) {
+        return;
+    }
+
+    usb_setup_pkt_t req;
+    uint8_t data[USB_EP0_BUF_SIZE];
+    HAL_NVIC_DisableIRQ(USB_UCPD1_2_IRQn);
+    if (!ep0_deferred) {
+        HAL_NVIC_EnableIRQ(USB_UCPD1_2_IRQn);
+        return;
+    }
+    req = ep0_deferred_setup;
+    uint16_t len = ep0_deferred_len;
+    memcpy(data, ep0_deferred_buf, len);
+    uint8_t seq = ep0_setup_seq;
+    ep0_deferred = 0;
+    HAL_NVIC_EnableIRQ(USB_UCPD1_2_IRQn);
+
+    usb_class_handler_t handler = NULL;
+    if (usb_app_ops) {
+        handler = ((req.bmRequestType & 0x60) == USB_REQ_TYPE_CLASS) ? usb_app_ops->class_handler
+                                                                      : usb_app_ops->vendor_handler;
+    }
+    int rc = handler ? handler(&req, data, len) : -1;
+
+    HAL_NVIC_DisableIRQ(USB_UCPD1_2_IRQn);
+    if (seq == ep0_setup_seq) {
+        if (rc == 0) {
+            usb_ep0_ack();
+        } else {
+            usb_ep0_stall();
         }
     }
+    HAL_NVIC_EnableIRQ(USB_UCPD1_2_IRQn);
 }
 
 void usb_ep0_ack(void) {
@@ -261,5 +535,10 @@ void usb_ep0_apply_pending_address(void) {
 
 void usb_core_reset_state(void) {
     ep0_pending_address = 0;
+    ep0_deferred = 0;
+    ep0_setup_seq++;
     usb_configuration = 0;
+    usb_ep1_reset();
+    usb_ep1_set_batching(0);
+    ep1_out_held = 0;
 }
@@ -30,7 +30,7 @@ typedef struct {
 
 typedef int (*usb_class_handler_t)(const usb_setup_pkt_t *req, const uint8_t *data, uint16_t len);
 typedef int (*usb_vendor_handler_t)(const usb_setup_pkt_t *req, const uint8_t *data, uint16_t len);
-typedef void (*usb_ep1_out_handler_t)(uint16_t rx_len);
+typedef void (*usb_ep1_out_handler_t)(const uint8_t *buf, uint16_t rx_len);
 
 typedef struct {
     usb_class_handler_t class_handler;
@@ -47,6 +47,32 @@ typedef enum { EP0_IDLE = 0, EP0_DATA_IN, EP0_DATA_OUT, EP0_STATUS } ep0_state_t
 #define USB_EP0_BUF_SIZE 64
 #define USB_EP1_BUF_SIZE 128
 
+/* EP1 IN frame ring: one slot per host frame, length must be a power of two */
+#ifndef USB_EP1_TX_RING_LEN
+#define USB_EP1_TX_RING_LEN 32
+#endif
+#define USB_EP1_TX_SLOT_SIZE 80
+#if (USB_EP1_TX_RING_LEN & (USB_EP1_TX_RING_LEN - 1)) != 0
+#error "USB_EP1_TX_RING_LEN must be a power of two"
+#endif
+
+/* Batched EP1 IN transfer: whole slots sent back to back, ended by a short packet */
+#define USB_EP1_BATCH_SIZE 512
+#define USB_EP1_MAX_PACKET 64
+
+/* Data leads and is word aligned so frames can be built in place and moved to PMA by words */
+typedef struct {
+    uint8_t data[USB_EP1_TX_SLOT_SIZE] __attribute__((aligned(4)));
+    uint16_t len;
+} usb_ep1_slot_t;
+
+typedef struct {
+    uint32_t queued;    /* frames accepted into the ring */
+    uint32_t overflow;  /* frames dropped because the ring was full */
+    uint16_t high_water;/* max ring occupancy seen */
+    uint32_t transfers; /* bulk IN transfers started */
+} usb_ep1_stats_t;
+
 /* EP0 buffers */
 
 extern volatile uint8_t *ep0_tx_ptr;
@@ -56,8 +82,7 @@ extern volatile usb_setup_pkt_t ep0_last_setup;
 extern volatile uint16_t ep0_out_len;
 
 /* EP1 buffers */
-extern volatile uint8_t ep1_tx_buf[USB_EP1_BUF_SIZE];
-extern volatile uint8_t ep1_rx_buf[USB_EP1_BUF_SIZE];
+extern volatile uint8_t ep1_rx_buf[2][USB_EP1_BUF_SIZE];
 
 /* EP0 state */
 extern volatile ep0_state_t ep0_state;
@@ -67,10 +92,21 @@ void usb_ep0_handle_standard(const usb_setup_pkt_t *req);
 void usb_ep0_send(uint8_t *buf, uint16_t len);
 void usb_ep0_ack(void);
 void usb_ep0_handle_out_data(uint16_t len);
+void usb_ep0_poll(void);
 
 
 int usb_ep1_send(const uint8_t *buf, uint16_t len);
+uint8_t *usb_ep1_reserve(void);
+void usb_ep1_commit(uint16_t len);
 void usb_ep1_tx_complete(void);
+void usb_ep1_reset(void);
+uint16_t usb_ep1_free_slots(void);
+void usb_ep1_set_batching(uint8_t enable);
+void usb_ep1_get_stats(usb_ep1_stats_t *stats);
+const uint8_t *usb_ep1_out_complete(void);
+void usb_ep1_out_hold(void);
+uint8_t usb_ep1_out_is_held(void);
+void usb_ep1_out_resume(void);
 
 void usb_ep0_stall(void);
 void usb_ep0_apply_pending_address(void);
@@ -55,11 +55,9 @@ void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum) {
 
     if (epnum == 0) {
         if (ep0_state == EP0_DATA_OUT) {
-            /* Data OUT stage done, send status IN */
+            /* Data OUT stage done; usb_ep0_poll() sends status IN once the request has run */
             uint16_t rx = HAL_PCD_EP_GetRxCount(hpcd, 0x00);
             usb_ep0_handle_out_data(rx);
-            usb_ep0_ack();
-
             return;
         }
         /* Status OUT stage done */
@@ -69,12 +67,12 @@ void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum) {
     }
 
     if (epnum == 1) {
-        /* EP1 OUT: re-arm for next packet */
+        /* EP1 OUT: the next packet can arrive while this one is handled */
         uint16_t rx = HAL_PCD_EP_GetRxCount(hpcd, 0x01);
+        const uint8_t *buf = usb_ep1_out_complete();
         if (usb_app_ops && usb_app_ops->ep1_out) {
-            usb_app_ops->ep1_out(rx);
+            usb_app_ops->ep1_out(buf, rx);
         }
-        HAL_PCD_EP_Receive(hpcd, 0x01, (uint8_t *) ep1_rx_buf, USB_EP1_BUF_SIZE);
     }
 }
 